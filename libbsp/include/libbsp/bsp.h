@@ -6,12 +6,102 @@
 typedef void* (*bsp_alloc_fn)(size_t size);
 typedef void (*bsp_free_fn)(void* ptr);
 
+/*
+Allocator with a user context. align is a power of two, free receives the size that was allocated.
+realloc is optional and may be NULL, growing buffers then allocates, copies and frees. When set it
+returns NULL on failure and leaves ptr allocated.
+*/
+typedef struct {
+	void* (*alloc)(void* ctx, size_t size, size_t align);
+	void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t new_size, size_t align);
+	void (*free)(void* ctx, void* ptr, size_t size);
+	void* ctx;
+} bsp_allocator_t;
+
 typedef struct bsp_t bsp_t;
 
+typedef void (*bsp_task_fn)(void* arg);
+
+/*
+Task executor supplied by the caller. submit may run fn(arg) on any thread or inline,
+wait returns once every task submitted so far has finished.
+*/
+typedef struct {
+	void (*submit)(void* ctx, bsp_task_fn fn, void* arg);
+	void (*wait)(void* ctx);
+	void* ctx;
+} bsp_executor_t;
+
+/* Progress of bsp_load_async, counted in whole lumps */
+typedef struct {
+	size_t bytes_done;
+	size_t bytes_total;
+	int lumps_done;
+	int lumps_total;
+	int finished;
+	int ok; /* result of the load once finished */
+} bsp_load_progress_t;
+
+typedef void (*bsp_load_done_fn)(bsp_t* bsp, int ok, void* ctx);
+
+/*
+Positional reader the loader pulls every byte through, offsets are from the start of the BSP.
+read_at returns the number of bytes read, anything short of len fails the load.
+size may be NULL when the total size is unknown, it is used to bounds check the lumps.
+view may be NULL, otherwise it returns the whole image when it is addressable memory (a mapping,
+a pak file held in memory) or NULL. Lumps are then used in place as with bsp_load_mmap.
+*/
+typedef struct {
+	size_t (*read_at)(void* ctx, uint64_t offset, void* buf, size_t len);
+	uint64_t (*size)(void* ctx);
+	const void* (*view)(void* ctx);
+	void* ctx;
+} bsp_io_t;
+
+/*
+Log levels. Define BSP_LOG_LEVEL when building the library to compile out every message
+above that level (BSP_LOG_NONE strips logging entirely).
+*/
+#define BSP_LOG_NONE 0
+#define BSP_LOG_ERROR 1
+#define BSP_LOG_WARN 2
+#define BSP_LOG_INFO 3
+#define BSP_LOG_DEBUG 4
+
+typedef void (*bsp_log_fn)(void* ctx, int level, const char* message);
+
+enum {
+	BSP_LOAD_BORROW = 1 << 0, /* bsp_load_memory: lump arrays alias the caller's buffer instead of copying it, see there */
+	BSP_LOAD_ARENA = 1 << 1, /* carve all lumps and entity strings from one allocation sized from the header */
+	BSP_LOAD_LAZY = 1 << 2, /* read only the header, each lump is loaded by its first accessor call or bsp_prefetch, entity and miptex tables outside the arena */
+	BSP_LOAD_ENTITY_FIELDS = 1 << 3, /* parse the typed fields of every entity for bsp_get_entity_fields */
+	BSP_LOAD_PVS_MATRIX = 1 << 4 /* decompress the PVS of every leaf into one bit matrix, see bsp_pvs_matrix_size */
+};
+
+/* One bit per lump, in file order */
+enum {
+	BSP_LUMP_ENTITIES = 1 << 0,
+	BSP_LUMP_PLANES = 1 << 1,
+	BSP_LUMP_MIPTEX = 1 << 2,
+	BSP_LUMP_VERTICES = 1 << 3,
+	BSP_LUMP_VISDATA = 1 << 4,
+	BSP_LUMP_NODES = 1 << 5,
+	BSP_LUMP_TEXINFO = 1 << 6,
+	BSP_LUMP_FACES = 1 << 7,
+	BSP_LUMP_LIGHTING = 1 << 8,
+	BSP_LUMP_CLIPNODES = 1 << 9,
+	BSP_LUMP_LEAVES = 1 << 10,
+	BSP_LUMP_FACELISTS = 1 << 11,
+	BSP_LUMP_EDGES = 1 << 12,
+	BSP_LUMP_SURFEDGES = 1 << 13,
+	BSP_LUMP_MODELS = 1 << 14,
+	BSP_LUMP_ALL = (1 << 15) - 1
+};
+
 typedef struct {
 	float normal[3];
 	float dist;
-	int32_t type; /* 0: Axial in x, 1: Axial in y, 2: Axial in z. Whatever that means*/
+	int32_t type; /* 0, 1, 2: normal is the x, y or z axis. 3, 4, 5: not axial, mostly facing x, y or z */
 } bsp_plane_t;
 
 typedef struct {
@@ -68,6 +158,19 @@ typedef struct {
 	size_t size;
 } bsp_lighting_t;
 
+/* Leaf contents, and the negative children of clipnodes */
+enum {
+	BSP_CONTENTS_EMPTY = -1,
+	BSP_CONTENTS_SOLID = -2,
+	BSP_CONTENTS_WATER = -3,
+	BSP_CONTENTS_SLIME = -4,
+	BSP_CONTENTS_LAVA = -5,
+	BSP_CONTENTS_SKY = -6
+};
+
+/* Collision hulls of a model: 0 point (nodes and leaves), 1 player 32x32x56, 2 large 64x64x88 (clipnodes) */
+#define BSP_MAX_HULLS 4
+
 typedef struct {
 	int32_t planenum; /* offset into planes which splits the node*/
 	int16_t children[2]; /* > 0 : front child node, -1: outside model, -2: inside model */
@@ -76,6 +179,7 @@ typedef struct {
 
 typedef struct {
 	int32_t contents;
+	int32_t visofs; /* offset into visdata, -1 if the leaf has no visibility info */
 	int16_t mins[3];
 	int16_t maxs[3];
 	uint16_t first_face;
@@ -102,6 +206,7 @@ typedef struct {
 	float maxs[3];
 	float origin[3];
 	int32_t headnode[4];
+	int32_t visleafs; /* leaves of the model, not counting the shared solid leaf 0 */
 	int32_t first_face;
 	int32_t num_faces;
 } bsp_model_t;
@@ -116,15 +221,120 @@ typedef struct {
 	size_t num_properties;
 } bsp_entity_t;
 
+/* Fields found in an entity, bits of bsp_entity_fields_t.present */
+enum {
+	BSP_FIELD_ORIGIN = 1 << 0,
+	BSP_FIELD_ANGLES = 1 << 1, /* "angles", or "angle" as the yaw */
+	BSP_FIELD_LIGHT = 1 << 2,
+	BSP_FIELD_SPAWNFLAGS = 1 << 3,
+	BSP_FIELD_MODEL = 1 << 4 /* "model" "*N" */
+};
+
+/*
+Typed entity fields as structure of arrays, indexed by entity. Missing fields are 0, model is -1.
+Integers past the int32_t range count as missing.
+*/
+typedef struct {
+	size_t count;
+	float* origin; /* x y z per entity */
+	float* angles; /* pitch yaw roll per entity */
+	float* light;
+	int32_t* spawnflags;
+	int32_t* model; /* brush model index */
+	uint32_t* present; /* BSP_FIELD_* */
+} bsp_entity_fields_t;
+
+/* Entity indices in file order, valid until the bsp is destroyed or reloaded */
+typedef struct {
+	const uint32_t* indices;
+	size_t count;
+} bsp_entity_span_t;
+
+/* malloc-style functions, blocks that need more alignment than they return are over-allocated */
 bsp_t* bsp_create(const bsp_alloc_fn alloc, const bsp_free_fn free);
+/* The allocator is copied. NULL uses the system allocator with alignment support. */
+bsp_t* bsp_create_ex(const bsp_allocator_t* allocator);
 void bsp_destroy(bsp_t* bsp);
+/*
+Messages up to level are passed to fn, or printed to stderr when fn is NULL.
+Defaults to BSP_LOG_WARN on stderr. Global, set it before loading.
+*/
+void bsp_set_log_callback(int level, bsp_log_fn fn, void* ctx);
+/* BSP_LOAD_* flags used by every subsequent load. bsp_load_memory adds its own flags argument to these. */
+void bsp_set_load_flags(bsp_t* bsp, int flags);
 
+/* Every load first releases the map the bsp held, so a bsp can be loaded again */
 int bsp_load_file(bsp_t* bsp, FILE* f);
+/* Loads only the BSP_LUMP_* lumps in lump_mask. The others stay empty, even with BSP_LOAD_LAZY. */
+int bsp_load_file_ex(bsp_t* bsp, FILE* f, uint32_t lump_mask);
+/*
+Like bsp_load_file, but each lump is read at its own offset (pread, overlapped ReadFile on Windows) and decoded
+as a separate task on exec while the calling thread waits. The allocator and log callback must be thread safe.
+Streams without a file descriptor, a NULL exec and BSP_LOAD_LAZY load as bsp_load_file does.
+*/
+int bsp_load_parallel(bsp_t* bsp, FILE* f, const bsp_executor_t* exec);
+/*
+Loads through a caller-provided reader, which is copied. With exec the lumps load as with bsp_load_parallel
+and read_at is called from several threads at once. A view, and the reader with BSP_LOAD_LAZY,
+must stay valid until bsp_destroy.
+*/
+int bsp_load_io(bsp_t* bsp, const bsp_io_t* io, const bsp_executor_t* exec);
+/*
+Loads the file at path on a background thread and returns immediately, 0 if the thread could not be started.
+on_done may be NULL, otherwise it runs on the loader thread once the load has finished and must not destroy the bsp.
+The load already reports as finished while it runs, bsp_load_wait also waits for it.
+Until bsp_load_poll reports completion the bsp may only be passed to bsp_load_progress, bsp_load_poll,
+bsp_load_wait and bsp_destroy, which waits for the load. BSP_LOAD_LAZY is ignored.
+*/
+int bsp_load_async(bsp_t* bsp, const char* path, bsp_load_done_fn on_done, void* ctx);
+/* Snapshot of the last bsp_load_async. Returns 0 if none was started. */
+int bsp_load_progress(const bsp_t* bsp, bsp_load_progress_t* progress);
+/* 1 once the last bsp_load_async has finished, never blocks */
+int bsp_load_poll(const bsp_t* bsp);
+/* Blocks until the last bsp_load_async has finished and returns its result */
+int bsp_load_wait(bsp_t* bsp);
+/*
+Maps the file copy-on-write and points the lump arrays straight into the mapping instead of copying them.
+Writes through the returned data stay private to the process and never reach the file.
+Lumps that are not aligned for their element type are copied. The mapping is released by the next load or bsp_destroy.
+*/
+int bsp_load_mmap(bsp_t* bsp, const char* path);
+/*
+Loads a complete BSP file image from memory.
+With BSP_LOAD_BORROW the buffer must stay valid and unmodified until bsp_destroy. The lumps used in place
+alias it even where an accessor returns them as mutable (bsp_get_miptex, visdata and lighting data):
+writing through those writes the caller's buffer, so they must be treated as read-only when it is.
+*/
+int bsp_load_memory(bsp_t* bsp, const void* data, size_t size, int flags);
+/*
+BSP_LOAD_LAZY: loads the BSP_LUMP_* lumps that are still pending in one batch. Returns 0 if any of them failed.
+Until every lump is loaded the FILE*, reader or memory passed to the loader must stay valid, and since accessors
+may load on first call a lazily loaded bsp must not be shared between threads before it is prefetched.
+*/
+int bsp_prefetch(bsp_t* bsp, uint32_t lump_mask);
 
 size_t bsp_entity_num_properties(const bsp_t* bsp, size_t entity_index);
 const char* bsp_entity_property_key(const bsp_t* bsp, size_t entity_index, size_t prop_index);
 const char* bsp_entity_property_value(const bsp_t* bsp, size_t entity_index, size_t prop_index);
 const char* bsp_entity_get_property(const bsp_t* bsp, size_t entity_index, const char* key);
+/* Hash of a property key, computed once by callers that look the same key up often */
+uint32_t bsp_key_hash(const char* key);
+/* bsp_entity_get_property with hash == bsp_key_hash(key) */
+const char* bsp_entity_get_property_h(const bsp_t* bsp, size_t entity_index, uint32_t hash, const char* key);
+/*
+Entity keys are interned: every distinct key is stored once and gets an id, stable until the bsp is
+destroyed or reloaded. Returns -1 for a key no entity in the map uses.
+*/
+int32_t bsp_key_id(const bsp_t* bsp, const char* key);
+const char* bsp_key_name(const bsp_t* bsp, int32_t key_id);
+int32_t bsp_entity_property_key_id(const bsp_t* bsp, size_t entity_index, size_t prop_index);
+/* Lookup by key id, an integer compare per probe */
+const char* bsp_entity_get_property_id(const bsp_t* bsp, size_t entity_index, int32_t key_id);
+/* NULL unless loaded with BSP_LOAD_ENTITY_FIELDS */
+const bsp_entity_fields_t* bsp_get_entity_fields(const bsp_t* bsp);
+/* Every entity with the given classname / targetname, from indices built while loading */
+bsp_entity_span_t bsp_find_entities_by_class(const bsp_t* bsp, const char* classname);
+bsp_entity_span_t bsp_find_entities_by_targetname(const bsp_t* bsp, const char* targetname);
 
 size_t bsp_num_vertices(const bsp_t* bsp);
 size_t bsp_num_planes(const bsp_t* bsp);
@@ -164,4 +374,158 @@ const bsp_edge_t* bsp_get_edges(const bsp_t* bsp);
 const bsp_surfedges_t* bsp_get_surfedges(const bsp_t* bsp);
 size_t bsp_get_num_models(const bsp_t* bsp);
 const bsp_model_t* bsp_get_models(const bsp_t* bsp);
+
+typedef struct {
+	int allsolid; /* the move never left solid */
+	int startsolid; /* the move started in solid */
+	int inopen; /* part of the move was in empty space */
+	int inwater; /* part of the move was in water, slime, lava or sky */
+	float fraction; /* part of the move made before hitting something, 1 if nothing was hit */
+	float endpos[3];
+	bsp_plane_t plane; /* surface hit, facing the start */
+} bsp_trace_t;
+
+typedef struct {
+	float start[3];
+	float end[3];
+	int32_t model;
+	int32_t hull;
+} bsp_trace_req_t;
+
+typedef struct {
+	bsp_trace_t trace;
+	int ok; /* what bsp_trace_hull returned */
+} bsp_trace_result_t;
+
+/*
+Index of the leaf containing p in the given model (0 is the world), found by walking the node
+tree. Points exactly on a plane go to its back side. -1 for a missing model or a malformed tree.
+*/
+int32_t bsp_point_leaf(const bsp_t* bsp, int32_t model, const float p[3]);
+/* bsp_point_leaf for n points stored as x y z triples, several points walk the tree at once */
+void bsp_point_leaf_batch(const bsp_t* bsp, int32_t model, const float* xyz, size_t n, int32_t* out_leaves);
+/* BSP_CONTENTS_* of the world's hull at p, solid for a missing hull */
+int32_t bsp_point_contents(const bsp_t* bsp, int hull, const float p[3]);
+/*
+Moves a box through one hull of a model from start to end, in model space. The hull already
+accounts for the box size, start and end are the box origin. Uses no heap and never writes to
+the bsp. Returns 0 for a missing model or hull or a malformed tree, the trace is then all solid.
+*/
+int bsp_trace_hull(const bsp_t* bsp, int32_t model, int hull, const float start[3], const float end[3], bsp_trace_t* out_trace);
+/*
+Runs n traces as bsp_trace_hull does, results in request order. Requests are grouped by the leaf
+their start is in and split into chunks submitted to exec, or run inline when exec is NULL. Lumps
+deferred by BSP_LOAD_LAZY are loaded on the calling thread first, the tasks only read the bsp.
+*/
+void bsp_trace_batch(const bsp_t* bsp, const bsp_trace_req_t* reqs, size_t n, bsp_trace_result_t* out, const bsp_executor_t* exec);
+
+/*
+PVS rows have one bit per leaf of the world, bit i (byte i / 8, bit i % 8) for leaf i + 1 since
+the solid leaf 0 has none. A leaf stored without visibility sees every leaf.
+*/
+size_t bsp_pvs_row_size(const bsp_t* bsp);
+/* Decompresses the PVS of a leaf into bsp_pvs_row_size bytes. Returns 0 for a leaf out of range. */
+int bsp_leaf_pvs(const bsp_t* bsp, int32_t leaf, uint8_t* out_bits);
+/*
+Keeps up to max_rows decompressed rows for bsp_leaf_pvs_cached, dropping the least recently used
+one when full. 0 keeps a single row. The setting is kept across loads.
+*/
+void bsp_set_pvs_cache(bsp_t* bsp, size_t max_rows);
+/*
+bsp_leaf_pvs through the cache, allocated on first use. The row is valid until it is dropped,
+at least until the next call. NULL for a leaf out of range or a failed allocation.
+*/
+const uint8_t* bsp_leaf_pvs_cached(bsp_t* bsp, int32_t leaf);
+/*
+Bytes the PVS matrix of the loaded map takes: a row per leaf, bsp_pvs_row_size rounded up to 64.
+With BSP_LOAD_LAZY this reads only the leaves and models, to decide before building it.
+*/
+size_t bsp_pvs_matrix_size(const bsp_t* bsp);
+/*
+Builds the matrix now, rows decompressed in tasks on exec or inline when exec is NULL.
+Loading with BSP_LOAD_PVS_MATRIX does this with the load's executor. Returns 0 if out of memory.
+*/
+int bsp_build_pvs_matrix(bsp_t* bsp, const bsp_executor_t* exec);
+/* 64-byte aligned matrix row of a leaf, NULL without the matrix */
+const uint8_t* bsp_pvs_row(const bsp_t* bsp, int32_t leaf);
+/* Whether leaf b is in the PVS of leaf a: a bit test with the matrix, a partial decode without */
+int bsp_leaf_can_see(const bsp_t* bsp, int32_t a, int32_t b);
+
+/* Storage of the PAS built by bsp_build_pas */
+enum {
+	BSP_PAS_DENSE = 0, /* a 64-byte aligned row per leaf, as the PVS matrix */
+	BSP_PAS_COMPRESSED = 1 << 0 /* run-length compressed like visdata */
+};
+
+/*
+Computes the potentially audible set of every leaf, the OR of the PVS rows of the leaves in its PVS.
+Leaves are split in tasks on exec, or run inline when exec is NULL. Rows have the PVS layout.
+Replaces an earlier PAS, returns 0 if out of memory.
+*/
+int bsp_build_pas(bsp_t* bsp, const bsp_executor_t* exec, int flags);
+/* Copies or decompresses the PAS of a leaf into bsp_pvs_row_size bytes, 0 before bsp_build_pas */
+int bsp_leaf_pas(const bsp_t* bsp, int32_t leaf, uint8_t* out_bits);
+/* 64-byte aligned PAS row of a leaf, NULL unless built with BSP_PAS_DENSE */
+const uint8_t* bsp_pas_row(const bsp_t* bsp, int32_t leaf);
+
+/*
+Leaves each entity touches, as bsp_point_leaf numbers: entity i has leaves[first[i]] up to
+leaves[first[i + 1]], so first holds count + 1 offsets.
+*/
+typedef struct {
+	const int32_t* leaves;
+	const uint32_t* first;
+	size_t count;
+} bsp_entity_leafsets_t;
+
+/*
+ORs the PVS of every non-solid world leaf the box touches into bsp_pvs_row_size bytes, read from
+the PVS matrix when there is one and merged straight from visdata when not. Returns the number of
+leaves touched, out_bits is then all zero if none.
+*/
+size_t bsp_pvs_union_box(const bsp_t* bsp, const float mins[3], const float maxs[3], uint8_t* out_bits);
+/*
+Sets bit i % 64 of out_mask[i / 64] when one of the leaves of entity i is in pvs_bits, a row as
+bsp_pvs_union_box fills. out_mask holds (count + 63) / 64 words. Returns the number of entities set.
+*/
+size_t bsp_entities_visible(const bsp_t* bsp, const uint8_t* pvs_bits, const bsp_entity_leafsets_t* sets, uint64_t* out_mask);
+
+/*
+Leaves of a model the box touches, solid ones left out, found by walking its nodes with the
+stack as only scratch. Stores up to cap of them in out and returns how many there are, 0 for a
+missing model or a malformed tree. topnode, when not NULL, gets the first node whose plane splits
+the box, -1 when the box fits in one leaf.
+*/
+size_t bsp_box_leaves(const bsp_t* bsp, int32_t model, const float mins[3], const float maxs[3], int32_t* out, size_t cap, int32_t* topnode);
+/*
+bsp_box_leaves for n boxes stored as mins then maxs, six floats each. Leaves go back to back into
+out, box i getting out[first[i]] up to out[first[i + 1]], so the result can be passed on as a
+bsp_entity_leafsets_t. first holds n + 1 offsets, topnodes may be NULL. Returns the leaves of all
+boxes, when that is more than cap the boxes past it are cut short.
+*/
+size_t bsp_box_leaves_batch(const bsp_t* bsp, int32_t model, const float* boxes, size_t n, int32_t* out, size_t cap, uint32_t* first, int32_t* topnodes);
+
+/*
+Area nodes: a kd-tree over the world bounds for finding the entities a box touches, as the
+engine's server keeps. Entities are linked by id, the caller's own index, and their links are
+pooled so linking allocates only when an id past the pool is first used. Not thread safe.
+*/
+typedef struct bsp_area_t bsp_area_t;
+
+/*
+Splits the bounds of model 0 depth times (at most 12), alternating the longer of x and y.
+The engine uses 4. The tree keeps the bsp's allocator but not the bsp. NULL without a world.
+*/
+bsp_area_t* bsp_area_create(const bsp_t* bsp, int depth);
+void bsp_area_destroy(bsp_area_t* area);
+/* Links id with a world space box, relinking it when already linked. Returns 0 if out of memory. */
+int bsp_area_link(bsp_area_t* area, uint32_t id, const float mins[3], const float maxs[3]);
+void bsp_area_unlink(bsp_area_t* area, uint32_t id);
+/* Updates the box of a linked id, it changes node only when it has to. Returns 0 if not linked. */
+int bsp_area_move(bsp_area_t* area, uint32_t id, const float mins[3], const float maxs[3]);
+/*
+Ids whose box touches the given one, boxes sharing a face count. Stores up to cap of them in out
+in no particular order and returns how many there are.
+*/
+size_t bsp_area_query_box(const bsp_area_t* area, const float mins[3], const float maxs[3], uint32_t* out, size_t cap);
 #endif
@@ -1,7 +1,33 @@
-#include <ctype.h>
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdarg.h>
+#if !defined(BSP_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(BSP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "libbsp/bsp.h"
 
 /*
@@ -39,14 +65,207 @@ typedef struct {
 	bsp_lump_t lumps[BSP_LUMP_COUNT];
 } bsp_header_t;
 
-struct bsp_t {
-	bsp_header_t header;
+/* Lump arrays are the file's records read as is, the public structs must keep their on-disk size */
+#define BSP_CHECK_SIZE(type, size) typedef char type##_size_check[sizeof(type) == (size) ? 1 : -1]
+BSP_CHECK_SIZE(bsp_plane_t, 20);
+BSP_CHECK_SIZE(bsp_node_t, 24);
+BSP_CHECK_SIZE(bsp_texinfo_t, 40);
+BSP_CHECK_SIZE(bsp_face_t, 20);
+BSP_CHECK_SIZE(bsp_clipnode_t, 8);
+BSP_CHECK_SIZE(bsp_leaf_t, 28);
+BSP_CHECK_SIZE(bsp_edge_t, 4);
+BSP_CHECK_SIZE(bsp_model_t, 64);
+
+#ifndef BSP_LOG_LEVEL
+#define BSP_LOG_LEVEL BSP_LOG_DEBUG
+#endif
+
+static struct {
+	int level;
+	bsp_log_fn fn;
+	void* ctx;
+} log_sink = { BSP_LOG_WARN, NULL, NULL };
+
+#if BSP_LOG_LEVEL > BSP_LOG_NONE
+#if defined(__GNUC__)
+__attribute__((format(printf, 2, 3)))
+#endif
+static void bsp_log(int level, const char* fmt, ...) {
+	char message[512];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+	if(log_sink.fn) {
+		log_sink.fn(log_sink.ctx, level, message);
+		return;
+	}
+	const char* prefix = level == BSP_LOG_ERROR ? "ERROR: " : level == BSP_LOG_WARN ? "WARNING: " : "";
+	fprintf(stderr, "[BSP] %s%s\n", prefix, message);
+}
+#endif
+
+/* Messages above BSP_LOG_LEVEL are compiled out, the rest are filtered by the runtime level first */
+#define BSP_LOG(lvl, ...) \
+	do { \
+		if((lvl) <= log_sink.level) { \
+			bsp_log((lvl), __VA_ARGS__); \
+		} \
+	} while(0)
+#if BSP_LOG_LEVEL >= BSP_LOG_ERROR
+#define BSP_ERROR(...) BSP_LOG(BSP_LOG_ERROR, __VA_ARGS__)
+#else
+#define BSP_ERROR(...) ((void)0)
+#endif
+#if BSP_LOG_LEVEL >= BSP_LOG_WARN
+#define BSP_WARN(...) BSP_LOG(BSP_LOG_WARN, __VA_ARGS__)
+#else
+#define BSP_WARN(...) ((void)0)
+#endif
+#if BSP_LOG_LEVEL >= BSP_LOG_INFO
+#define BSP_INFO(...) BSP_LOG(BSP_LOG_INFO, __VA_ARGS__)
+#else
+#define BSP_INFO(...) ((void)0)
+#endif
+#if BSP_LOG_LEVEL >= BSP_LOG_DEBUG
+#define BSP_DEBUG(...) BSP_LOG(BSP_LOG_DEBUG, __VA_ARGS__)
+#else
+#define BSP_DEBUG(...) ((void)0)
+#endif
+
+/* Part of the arena planned for one lump, so lumps can be loaded in any order or at the same time */
+typedef struct {
+	uint8_t* base;
+	size_t size;
+	size_t used;
+} bsp_region_t;
+
+/* Where lump bytes come from. Either a positional reader or a complete file image in memory. */
+typedef struct {
+	bsp_io_t io;
+	const uint8_t* data; /* whole image when it is addressable, read directly and borrowable */
+	size_t size; /* SIZE_MAX when unknown */
+	int flags; /* BSP_LOAD_* */
+	int serial; /* io.read_at must not be called from several threads at once */
+	bsp_region_t region; /* arena space of the lump being read, empty without BSP_LOAD_ARENA */
+	void* mapping; /* mapping handed to the bsp by bsp_load_mmap */
+	size_t mapping_size;
+	int text_read; /* the entity text was read ahead by create_arena for this load */
+} bsp_source_t;
+
+#define BSP_ALIGNOF(type) offsetof(struct { char c; type t; }, t)
+#define BSP_DEFAULT_ALIGN 16
+#define BSP_CACHE_LINE 64
+
+/*
+Element size of each lump as stored in bsp_t, the alignment it needs to be used in place
+and the alignment requested when it is copied. The lumps walked by traversal code get a cache line.
+*/
+static const struct {
+	size_t size;
+	size_t align;
+	size_t alloc_align;
+} lump_layout[BSP_LUMP_COUNT] = {
+	{ 1, 1, BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_plane_t), BSP_ALIGNOF(bsp_plane_t), BSP_CACHE_LINE },
+	{ 1, BSP_ALIGNOF(int32_t), BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_vertex_t), BSP_ALIGNOF(bsp_vertex_t), BSP_CACHE_LINE },
+	{ 1, 1, BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_node_t), BSP_ALIGNOF(bsp_node_t), BSP_CACHE_LINE },
+	{ sizeof(bsp_texinfo_t), BSP_ALIGNOF(bsp_texinfo_t), BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_face_t), BSP_ALIGNOF(bsp_face_t), BSP_DEFAULT_ALIGN },
+	{ 1, 1, BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_clipnode_t), BSP_ALIGNOF(bsp_clipnode_t), BSP_CACHE_LINE },
+	{ sizeof(bsp_leaf_t), BSP_ALIGNOF(bsp_leaf_t), BSP_DEFAULT_ALIGN },
+	{ sizeof(int16_t), BSP_ALIGNOF(int16_t), BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_edge_t), BSP_ALIGNOF(bsp_edge_t), BSP_DEFAULT_ALIGN },
+	{ sizeof(int32_t), BSP_ALIGNOF(int32_t), BSP_DEFAULT_ALIGN },
+	{ sizeof(bsp_model_t), BSP_ALIGNOF(bsp_model_t), BSP_DEFAULT_ALIGN }
+};
+
+typedef struct {
+	size_t num_entities;
+	size_t num_properties;
+} entity_counts_t;
+
+/* Entities that have a key, sorted by its value and then by entity index */
+typedef struct {
+	uint32_t* entities;
+	const char** values;
+	size_t count;
+} value_index_t;
+
+/* Entry of the decompressed PVS cache, linked from most to least recently used */
+typedef struct {
+	int32_t leaf;
+	uint32_t prev;
+	uint32_t next;
+} pvs_entry_t;
+
+#define BSP_PVS_NONE UINT32_MAX
+
+typedef struct {
+	uint8_t* block; /* rows, entries and slots in one allocation */
+	size_t block_size;
+	size_t row_size;
+	size_t capacity;
+	size_t count;
+	uint8_t* rows;
+	pvs_entry_t* entries;
+	int32_t* slots; /* entry of each leaf, -1 when not cached */
+	uint32_t head; /* most recently used */
+	uint32_t tail;
+} pvs_cache_t;
 
+/* State of a bsp_load_async call. Allocated separately so it survives the bsp_cleanup of a failed load. */
+typedef struct {
+#if defined(_WIN32)
+	HANDLE thread;
+	CRITICAL_SECTION lock;
+#else
+	pthread_t thread;
+	pthread_mutex_t lock;
+#endif
+	int joined;
+	char* path;
+	size_t path_size;
+	bsp_load_done_fn on_done;
+	void* ctx;
+	bsp_load_progress_t progress; /* guarded by lock */
+} bsp_async_t;
+
+/* Plain functions passed to bsp_create, the context of the allocator wrapping them */
+typedef struct {
 	bsp_alloc_fn alloc;
 	bsp_free_fn free;
+} plain_fns_t;
+
+struct bsp_t {
+	bsp_header_t header;
+
+	bsp_allocator_t allocator;
+	plain_fns_t plain;
+	int load_flags;
 
 	bsp_entity_t* entities;
 	size_t num_entities;
+	bsp_property_t* properties; /* one block shared by all entities */
+	size_t num_properties;
+	/* Open addressing index over (entity, key id), slots hold property index + 1 */
+	uint32_t* property_keys; /* key id of each property */
+	uint32_t* property_slots;
+	size_t num_property_slots;
+	/* Interned keys: every distinct key once in order of first appearance, ids index them */
+	const char** keys;
+	uint32_t* key_hashes;
+	size_t num_keys;
+	uint32_t* key_slots; /* open addressing over key_hashes, slots hold id + 1 */
+	size_t num_key_slots;
+	value_index_t classnames;
+	value_index_t targetnames;
+	bsp_entity_fields_t fields; /* BSP_LOAD_ENTITY_FIELDS */
+	char* entity_text; /* entity lump text, keys and values point into it */
+	size_t entity_text_size;
 
 	bsp_plane_t* planes;
 	size_t num_planes;
@@ -87,747 +306,2065 @@ struct bsp_t {
 
 	bsp_model_t* models;
 	size_t num_models;
+
+	/* File image the lump arrays may point into. Pointers inside it are never freed. */
+	const uint8_t* image;
+	size_t image_size;
+	/* Set when the image is a mapping owned by this bsp (bsp_load_mmap) */
+	void* mapping;
+	size_t mapping_size;
+
+	/* BSP_LOAD_LAZY: the source stays attached while lumps are pending */
+	bsp_source_t source;
+	uint32_t pending;
+	uint32_t failed;
+
+	bsp_async_t* async;
+
+	/* BSP_LOAD_PVS_MATRIX: the decompressed row of every leaf, pvs_stride bytes apart */
+	uint8_t* pvs_matrix;
+	size_t pvs_matrix_size;
+	size_t pvs_stride;
+	int pvs_matrix_wanted; /* BSP_LOAD_LAZY defers the build to the first query */
+	/* bsp_build_pas: rows pvs_stride apart, or compressed like visdata at pas_offsets */
+	uint8_t* pas;
+	size_t pas_size;
+	uint32_t* pas_offsets;
+	size_t pas_rows;
+
+	/* bsp_leaf_pvs_cached, allocated on first use. The capacity is kept across loads. */
+	size_t pvs_cache_rows;
+	pvs_cache_t pvs_cache;
+
+	/* BSP_LOAD_ARENA: one block holding every lump and entity string, released with a single free */
+	uint8_t* arena;
+	size_t arena_size;
+	bsp_region_t arena_lumps[BSP_LUMP_COUNT];
 };
 
-static void* bsp_malloc(bsp_t* bsp, size_t size) {
-	return bsp->alloc(size);
+static size_t align_up(size_t n, size_t align) {
+	return (n + align - 1) & ~(align - 1);
+}
+
+static void* bsp_heap_alloc(bsp_t* bsp, size_t size, size_t align) {
+	return bsp->allocator.alloc(bsp->allocator.ctx, size, align);
+}
+
+static void bsp_heap_free(bsp_t* bsp, void* p, size_t size) {
+	bsp->allocator.free(bsp->allocator.ctx, p, size);
+}
+
+/* Grows or shrinks a block, through realloc when the allocator has one. NULL leaves p allocated. */
+static void* allocator_realloc(const bsp_allocator_t* a, void* p, size_t old_size, size_t size, size_t align) {
+	if(!p) {
+		return a->alloc(a->ctx, size, align);
+	}
+	if(a->realloc) {
+		return a->realloc(a->ctx, p, old_size, size, align);
+	}
+	void* q = a->alloc(a->ctx, size, align);
+	if(q) {
+		memcpy(q, p, old_size < size ? old_size : size);
+		a->free(a->ctx, p, old_size);
+	}
+	return q;
+}
+
+/* Memory for the lump being read, carved from its arena region while it lasts */
+static void* lump_alloc(bsp_t* bsp, bsp_source_t* src, size_t size, size_t align) {
+	bsp_region_t* r = &src->region;
+	if(r->base) {
+		uintptr_t base = (uintptr_t)r->base;
+		size_t offset = (size_t)(align_up(base + r->used, align) - base);
+		if(offset <= r->size && size <= r->size - offset) {
+			r->used = offset + size;
+			return r->base + offset;
+		}
+		if(src->flags & BSP_LOAD_LAZY) {
+			/* Expected, create_arena could not size what it did not read */
+			BSP_DEBUG("Arena region full, allocating %zu bytes from the heap", size);
+		} else {
+			BSP_WARN("Arena exhausted, allocating %zu bytes from the heap", size);
+		}
+	}
+	return bsp_heap_alloc(bsp, size, align);
 }
 
-static void* bsp_calloc(bsp_t* bsp, size_t nmemb, size_t size) {
+static void* lump_calloc(bsp_t* bsp, bsp_source_t* src, size_t nmemb, size_t size) {
 	size_t total = nmemb * size;
-	void* p = bsp_malloc(bsp, total);
+	void* p = lump_alloc(bsp, src, total, BSP_DEFAULT_ALIGN);
 	if(p) {
 		memset(p, 0, total);
 	}
 	return p;
 }
 
-static void bsp_free_ptr(bsp_t* bsp, void* p) {
-	if(!p) {
+static int in_block(const void* p, const void* base, size_t size) {
+	uintptr_t u = (uintptr_t)p;
+	uintptr_t b = (uintptr_t)base;
+	return base && u >= b && u < b + size;
+}
+
+/* Borrowed from the file image or carved from the arena, never freed individually */
+static int bsp_is_borrowed(const bsp_t* bsp, const void* p) {
+	return in_block(p, bsp->image, bsp->image_size) || in_block(p, bsp->arena, bsp->arena_size);
+}
+
+static void bsp_free_ptr(bsp_t* bsp, void* p, size_t size) {
+	if(!p || bsp_is_borrowed(bsp, p)) {
 		return;
 	}
-	bsp->free(p);
+	bsp_heap_free(bsp, p, size);
 }
 
-static void* bsp_realloc_grow(bsp_t* bsp, void* old, size_t old_count, size_t new_count, size_t elem_size) {
-	void* np = bsp_malloc(bsp, new_count * elem_size);
-	if(!np) {
-		return NULL;
+/* A stream with a descriptor can be read at any offset from several threads at once */
+static int file_is_positional(FILE* fp) {
+#if defined(_WIN32)
+	return _get_osfhandle(_fileno(fp)) != -1;
+#else
+	return fileno(fp) >= 0;
+#endif
+}
+
+/*
+bsp_io_t over a stdio stream. Reads at an absolute offset without moving a shared cursor, so lumps can be
+read concurrently. Streams without a descriptor (fmemopen, custom cookies) fall back to fseek and fread.
+*/
+static size_t file_read_at(void* ctx, uint64_t offset, void* buf, size_t len) {
+	FILE* fp = (FILE*)ctx;
+	uint8_t* dst = (uint8_t*)buf;
+	size_t done = 0;
+#if defined(_WIN32)
+	intptr_t handle = _get_osfhandle(_fileno(fp));
+	if(handle != -1) {
+		while(done < len) {
+			OVERLAPPED ov;
+			memset(&ov, 0, sizeof(ov));
+			ov.Offset = (DWORD)(offset + done);
+			ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+			DWORD chunk = len - done > 0x40000000 ? 0x40000000 : (DWORD)(len - done);
+			DWORD n = 0;
+			if(!ReadFile((HANDLE)handle, dst + done, chunk, &n, &ov) || n == 0) {
+				break;
+			}
+			done += n;
+		}
+		return done;
+	}
+#else
+	int fd = fileno(fp);
+	if(fd >= 0) {
+		while(done < len) {
+			ssize_t n = pread(fd, dst + done, len - done, (off_t)(offset + done));
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+			if(n <= 0) {
+				break;
+			}
+			done += (size_t)n;
+		}
+		return done;
+	}
+#endif
+	if(offset > LONG_MAX || fseek(fp, (long)offset, SEEK_SET) != 0) {
+		return 0;
+	}
+	return fread(dst, 1, len, fp);
+}
+
+static uint64_t file_size(void* ctx) {
+	FILE* fp = (FILE*)ctx;
+#if defined(_WIN32)
+	__int64 size = _filelengthi64(_fileno(fp));
+	return size < 0 ? UINT64_MAX : (uint64_t)size;
+#else
+	struct stat st;
+	int fd = fileno(fp);
+	if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return UINT64_MAX;
 	}
-	if(old && old_count) {
-		size_t copy = old_count * elem_size;
-		size_t max = new_count * elem_size;
-		if(copy > max)
-			copy = max;
-		memcpy(np, old, copy);
+	return (uint64_t)st.st_size;
+#endif
+}
+
+static void io_source(bsp_source_t* src, const bsp_io_t* io, int flags) {
+	memset(src, 0, sizeof(*src));
+	src->io = *io;
+	src->flags = flags;
+	uint64_t size = io->size ? io->size(io->ctx) : UINT64_MAX;
+	src->size = size > SIZE_MAX ? SIZE_MAX : (size_t)size;
+	const void* view = io->view ? io->view(io->ctx) : NULL;
+	if(view && size != UINT64_MAX) {
+		src->data = (const uint8_t*)view;
+	} else {
+		src->flags &= ~BSP_LOAD_BORROW;
 	}
-	bsp_free_ptr(bsp, old);
-	return np;
 }
 
-static int read_exact(FILE* fp, void* buf, size_t size) {
-	return fread(buf, 1, size, fp) == size ? 1 : 0;
+static void file_source(bsp_source_t* src, FILE* fp, int flags) {
+	bsp_io_t io = { file_read_at, file_size, NULL, fp };
+	io_source(src, &io, flags);
+	src->serial = !file_is_positional(fp);
 }
 
-static int seek_lump(FILE* fp, const bsp_lump_t* l) {
+static void memory_source(bsp_source_t* src, const void* data, size_t size, int flags) {
+	memset(src, 0, sizeof(*src));
+	src->data = (const uint8_t*)data;
+	src->size = size;
+	src->flags = flags;
+}
+
+static int read_at(const bsp_source_t* src, size_t offset, void* buf, size_t size) {
+	if(offset > src->size || size > src->size - offset) {
+		return 0;
+	}
+	if(src->data) {
+		memcpy(buf, src->data + offset, size);
+		return 1;
+	}
+	return src->io.read_at(src->io.ctx, offset, buf, size) == size;
+}
+
+static int check_lump(const bsp_source_t* src, const bsp_lump_t* l) {
 	if(l->offset < 0 || l->length < 0) {
 		return 0;
 	}
-	return fseek(fp, l->offset, SEEK_SET) == 0;
+	return (size_t)l->offset <= src->size && (size_t)l->length <= src->size - (size_t)l->offset;
 }
 
-static void* alloc_array(bsp_t* bsp, size_t count, size_t elem_size) {
+static void* alloc_array(bsp_t* bsp, bsp_source_t* src, size_t count, size_t elem_size) {
+	if(count == 0) {
+		return NULL;
+	}
+	return lump_alloc(bsp, src, count * elem_size, BSP_DEFAULT_ALIGN);
+}
+
+static void free_array(bsp_t* bsp, void* p, size_t count, size_t elem_size) {
+	bsp_free_ptr(bsp, p, count * elem_size);
+}
+
+/*
+Fetch count elements of a lump.
+A borrowable file image is referenced in place when the lump is suitably aligned for its element type,
+otherwise the elements are copied into a fresh allocation.
+*/
+static void* fetch_lump(bsp_t* bsp, bsp_source_t* src, const bsp_lump_t* l, size_t count, int lump) {
+	size_t align = lump_layout[lump].align;
+	size_t size = count * lump_layout[lump].size;
 	if(count == 0) {
 		return NULL;
 	}
-	return bsp_calloc(bsp, count, elem_size);
+	if(src->data) {
+		const uint8_t* p = src->data + l->offset;
+		if(src->flags & BSP_LOAD_BORROW) {
+			if(((uintptr_t)p & (align - 1)) == 0) {
+				return (void*)p;
+			}
+			BSP_INFO("Lump at offset %d is misaligned, copying %zu bytes", l->offset, size);
+		}
+		void* copy = lump_alloc(bsp, src, size, lump_layout[lump].alloc_align);
+		if(copy) {
+			memcpy(copy, p, size);
+		}
+		return copy;
+	}
+	void* buf = lump_alloc(bsp, src, size, lump_layout[lump].alloc_align);
+	if(!buf) {
+		return NULL;
+	}
+	if(!read_at(src, (size_t)l->offset, buf, size)) {
+		bsp_free_ptr(bsp, buf, size);
+		return NULL;
+	}
+	return buf;
 }
 
-static int read_header(FILE* fp, bsp_header_t* hdr) {
-	fprintf(stderr, "[BSP] Reading header...\n");
-	if(!read_exact(fp, hdr, sizeof(*hdr))) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read header\n");
+static int read_header(bsp_source_t* src, bsp_header_t* hdr) {
+	BSP_DEBUG("Reading header...");
+	if(!read_at(src, 0, hdr, sizeof(*hdr))) {
+		BSP_ERROR("Failed to read header");
 		return 0;
 	}
 	if(hdr->version != BSP_VERSION) {
-		fprintf(stderr, "[BSP] ERROR: Unsupported BSP version: %d (expected %d)\n", hdr->version, BSP_VERSION);
+		BSP_ERROR("Unsupported BSP version: %d (expected %d)", hdr->version, BSP_VERSION);
 		return 0;
 	}
-	fprintf(stderr, "[BSP] Header OK: version=%d\n", hdr->version);
+	BSP_DEBUG("Header OK: version=%d", hdr->version);
 	return 1;
 }
 
-static char* read_lump_text(bsp_t* bsp, FILE* fp, const bsp_lump_t* l) {
-	char* buf = (char*)bsp_malloc(bsp, (size_t)l->length + 1);
+/*
+The entity text is scanned a whole vector at a time, AVX2 or SSE2 depending on the target
+(BSP_NO_SIMD forces the scalar loops). Text buffers carry BSP_TEXT_PAD zero bytes past the
+terminator so a vector load starting at or before the terminator stays inside the buffer.
+*/
+#define BSP_TEXT_PAD 64
+
+#if !defined(BSP_NO_SIMD) && defined(__AVX2__)
+#define BSP_SCAN_WIDTH 32
+#define BSP_SCAN_ALL 0xFFFFFFFFu
+typedef __m256i scan_vec_t;
+#define scan_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define scan_store(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define scan_splat(c) _mm256_set1_epi8(c)
+#define scan_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define scan_or(a, b) _mm256_or_si256(a, b)
+#define scan_sub(a, b) _mm256_sub_epi8(a, b)
+#define scan_min(a, b) _mm256_min_epu8(a, b)
+#define scan_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif !defined(BSP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BSP_SCAN_WIDTH 16
+#define BSP_SCAN_ALL 0xFFFFu
+typedef __m128i scan_vec_t;
+#define scan_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define scan_store(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define scan_splat(c) _mm_set1_epi8(c)
+#define scan_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define scan_or(a, b) _mm_or_si128(a, b)
+#define scan_sub(a, b) _mm_sub_epi8(a, b)
+#define scan_min(a, b) _mm_min_epu8(a, b)
+#define scan_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+#if defined(BSP_SCAN_WIDTH)
+static unsigned first_bit(uint64_t mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	if(_BitScanForward(&index, (unsigned long)mask)) {
+		return (unsigned)index;
+	}
+	_BitScanForward(&index, (unsigned long)(mask >> 32));
+	return (unsigned)index + 32;
+#else
+	return (unsigned)__builtin_ctzll(mask);
+#endif
+}
+#endif
+
+/* isspace in the C locale: space and \t \n \v \f \r */
+static int is_space(unsigned char c) {
+	return c == ' ' || (unsigned char)(c - '\t') <= 4;
+}
+
+/* NUL terminated copy of a text lump, padded for the vector scans */
+static char* read_lump_text(bsp_t* bsp, bsp_source_t* src, const bsp_lump_t* l) {
+	size_t size = (size_t)l->length + 1 + BSP_TEXT_PAD;
+	char* buf = (char*)lump_alloc(bsp, src, size, 1);
 	if(!buf) {
 		return NULL;
 	}
-	if(fread(buf, 1, (size_t)l->length, fp) != (size_t)l->length) {
-		bsp_free_ptr(bsp, buf);
+	if(!read_at(src, (size_t)l->offset, buf, (size_t)l->length)) {
+		bsp_free_ptr(bsp, buf, size);
 		return NULL;
 	}
-	buf[l->length] = '\0';
+	memset(buf + l->length, 0, 1 + BSP_TEXT_PAD);
 	return buf;
 }
 
 static char* skip_whitespace(char* p) {
-	while(*p && isspace((unsigned char)*p)) {
+	/* Most runs are a single newline or space, check two bytes before going wide */
+	if(!is_space((unsigned char)p[0])) {
+		return p;
+	}
+	if(!is_space((unsigned char)p[1])) {
+		return p + 1;
+	}
+	p += 2;
+#if defined(BSP_SCAN_WIDTH)
+	const scan_vec_t space = scan_splat(' ');
+	const scan_vec_t tab = scan_splat('\t');
+	const scan_vec_t four = scan_splat(4);
+	for(;;) {
+		scan_vec_t v = scan_load(p);
+		scan_vec_t ctrl = scan_sub(v, tab);
+		scan_vec_t ws = scan_or(scan_eq(v, space), scan_eq(scan_min(ctrl, four), ctrl));
+		uint32_t mask = ~scan_mask(ws) & BSP_SCAN_ALL;
+		if(mask) {
+			return p + first_bit(mask);
+		}
+		p += BSP_SCAN_WIDTH;
+	}
+#else
+	while(is_space((unsigned char)*p)) {
+		p++;
+	}
+	return p;
+#endif
+}
+
+/*
+Quote and terminator positions in a 64 byte block of the text. Keys and values are short,
+so one set of vector compares usually serves several of them.
+*/
+typedef struct {
+	const char* base;
+	uint64_t quotes;
+} quote_index_t;
+
+/* First quote or the terminator at or after p. Calls must move forward through the text. */
+static char* find_quote(quote_index_t* index, char* p) {
+#if defined(BSP_SCAN_WIDTH)
+	const scan_vec_t quote = scan_splat('"');
+	const scan_vec_t zero = scan_splat(0);
+	for(;;) {
+		if(index->base && p < index->base + 64) {
+			uint64_t mask = index->quotes >> (p - index->base);
+			if(mask) {
+				return p + first_bit(mask);
+			}
+			p = (char*)index->base + 64;
+		}
+		index->base = p;
+		index->quotes = 0;
+		for(int i = 0; i < 64; i += BSP_SCAN_WIDTH) {
+			scan_vec_t v = scan_load(p + i);
+			index->quotes |= (uint64_t)scan_mask(scan_or(scan_eq(v, quote), scan_eq(v, zero))) << i;
+		}
+	}
+#else
+	(void)index;
+	while(*p && *p != '"') {
 		p++;
 	}
 	return p;
+#endif
 }
 
-static char* parse_string(bsp_t* bsp, char* p, char** out) {
+static char* parse_string(quote_index_t* index, char* p, char** out, size_t* out_len) {
 	p = skip_whitespace(p);
 	if(*p != '"') {
 		return NULL;
 	}
 	p++;
 	char* start = p;
-	while(*p && *p != '"') {
-		p++;
-	}
+	p = find_quote(index, p);
 	if(!*p) {
 		return NULL;
 	}
-	size_t len = (size_t)(p - start);
-	char* str = (char*)bsp_malloc(bsp, len + 1);
-	if(!str) {
-		return NULL;
-	}
-	memcpy(str, start, len);
-	str[len] = '\0';
-	*out = str;
+	*out = start;
+	*out_len = (size_t)(p - start);
 	return p + 1;
 }
 
-static int read_entities(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
-	fprintf(stderr, "[BSP] Reading entities lump (offset=%d, length=%d)...\n", l->offset, l->length);
-	if(l->length <= 0) {
-		fprintf(stderr, "[BSP] Entities lump empty\n");
-		bsp->entities = NULL;
-		bsp->num_entities = 0;
-		return 1;
-	}
-	if(!seek_lump(fp, l)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to seek to entities lump\n");
-		return 0;
-	}
-	char* text = read_lump_text(bsp, fp, l);
-	if(!text) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read entities text\n");
-		return 0;
-	}
-	size_t capacity = 16;
-	bsp_entity_t* entities = (bsp_entity_t*)bsp_calloc(bsp, capacity, sizeof(bsp_entity_t));
-	size_t num_entities = 0;
-
+/*
+Walks the entity text. Without entities/props this only counts, so the fill pass
+can allocate exactly what it needs. The fill pass parses in place: the closing quotes
+are overwritten with NULs and keys and values point into the text.
+Parsing stops at the first malformed property.
+*/
+static void walk_entities(char* text, entity_counts_t* counts, bsp_entity_t* entities, bsp_property_t* props) {
+	memset(counts, 0, sizeof(*counts));
+	quote_index_t index = { NULL, 0 };
 	char* p = text;
 	while(*p) {
 		p = skip_whitespace(p);
-		if(*p == '{') {
-			p++;
-			if(num_entities >= capacity) {
-				size_t old = capacity;
-				capacity *= 2;
-				entities = (bsp_entity_t*)bsp_realloc_grow(bsp, entities, old, capacity, sizeof(bsp_entity_t));
-				if(!entities) {
-					bsp_free_ptr(bsp, text);
-					return 0;
-				}
+		if(*p != '{') {
+			if(*p) {
+				p++;
 			}
-			bsp_entity_t* ent = &entities[num_entities++];
-			ent->properties = NULL;
+			continue;
+		}
+		p++;
+		bsp_entity_t* ent = NULL;
+		if(entities) {
+			ent = &entities[counts->num_entities];
+			ent->properties = props + counts->num_properties;
 			ent->num_properties = 0;
+		}
+		counts->num_entities++;
 
-			size_t prop_cap = 8;
-			bsp_property_t* props = (bsp_property_t*)bsp_calloc(bsp, prop_cap, sizeof(bsp_property_t));
-			size_t num_props = 0;
-
-			while(*p && *p != '}') {
-				char* key = NULL;
-				char* val = NULL;
-				p = parse_string(bsp, p, &key);
-				if(!p) {
-					break;
-				}
-				p = parse_string(bsp, p, &val);
-				if(!p) {
-					bsp_free_ptr(bsp, key);
-					break;
-				}
-
-				if(num_props >= prop_cap) {
-					size_t oldp = prop_cap;
-					prop_cap *= 2;
-					props = (bsp_property_t*)bsp_realloc_grow(bsp, props, oldp, prop_cap, sizeof(bsp_property_t));
-					if(!props) {
-						bsp_free_ptr(bsp, text);
-						return 0;
-					}
-				}
-				props[num_props].key = key;
-				props[num_props].value = val;
-				num_props++;
-
-				p = skip_whitespace(p);
-			}
+		for(;;) {
+			p = skip_whitespace(p);
 			if(*p == '}') {
 				p++;
+				break;
 			}
-
-
-			ent->properties = props;
-			ent->num_properties = num_props;
-		} else {
-			p++;
+			char* key;
+			char* val;
+			size_t key_len;
+			size_t val_len;
+			char* next = parse_string(&index, p, &key, &key_len);
+			if(next) {
+				next = parse_string(&index, next, &val, &val_len);
+			}
+			if(!next) {
+				if(!entities) {
+					BSP_WARN("Malformed entity property, ignoring the rest of the entities lump");
+				}
+				return;
+			}
+			p = next;
+			if(ent) {
+				bsp_property_t* prop = &props[counts->num_properties];
+				key[key_len] = '\0';
+				val[val_len] = '\0';
+				prop->key = key;
+				prop->value = val;
+				ent->num_properties++;
+			}
+			counts->num_properties++;
 		}
 	}
+}
 
-	bsp->entities = entities;
-	bsp->num_entities = num_entities;
-	fprintf(stderr, "[BSP] Entities loaded: %zu entities\n", num_entities);
-
-	bsp_free_ptr(bsp, text);
-	return 1;
+uint32_t bsp_key_hash(const char* key) {
+	uint32_t h = 2166136261u;
+	for(; *key; ++key) {
+		h ^= (unsigned char)*key;
+		h *= 16777619u;
+	}
+	return h;
 }
 
-void free_entities(bsp_t* bsp) {
-	if(!bsp || !bsp->entities) {
-		return;
+/* Power of two with at most half the slots in use */
+static size_t slot_count(size_t count) {
+	size_t n = 1;
+	while(n < count * 2) {
+		n <<= 1;
 	}
+	return count ? n : 0;
+}
 
-	for(size_t i = 0; i < bsp->num_entities; i++) {
-		bsp_entity_t* ent = &bsp->entities[i];
-		if(ent->properties) {
-			for(size_t j = 0; j < ent->num_properties; j++) {
-				bsp_property_t* prop = &ent->properties[j];
-				fprintf(stderr, "[BSP] Freeing prop %zu key %s of entity %zu\n", j, prop->key, i);
-				bsp_free_ptr(bsp, (void*)prop->key); /* cast to silence Wdiscarded-qualifiers */
-				fprintf(stderr, "[BSP] Freeing prop %zu value %s of entity %zu\n", j, prop->value, i);
-				bsp_free_ptr(bsp, (void*)prop->value);
-			}
-			fprintf(stderr, "[BSP] Freeing props of entity %zu\n", i);
-			bsp_free_ptr(bsp, ent->properties);
+static size_t property_slot(size_t entity_index, uint32_t hash, size_t mask) {
+	uint32_t h = hash ^ ((uint32_t)entity_index * 0x9E3779B1u);
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	return h & mask;
+}
+
+/*
+Bytes of everything read_entities allocates, in the order it allocates it. The number of
+distinct keys is not known before parsing, the key tables are sized for one per property.
+*/
+static size_t entity_region_size(const entity_counts_t* counts, size_t text_size, int flags) {
+	size_t size = counts->num_entities * sizeof(bsp_entity_t);
+	size = align_up(size, BSP_DEFAULT_ALIGN) + counts->num_properties * sizeof(bsp_property_t);
+	size = align_up(size, BSP_DEFAULT_ALIGN) + counts->num_properties * sizeof(uint32_t);
+	size = align_up(size, BSP_DEFAULT_ALIGN) + slot_count(counts->num_properties) * sizeof(uint32_t);
+	size += text_size;
+	size = align_up(size, BSP_DEFAULT_ALIGN) + counts->num_properties * sizeof(const char*);
+	size = align_up(size, BSP_DEFAULT_ALIGN) + counts->num_properties * sizeof(uint32_t);
+	size = align_up(size, BSP_DEFAULT_ALIGN) + slot_count(counts->num_properties) * sizeof(uint32_t);
+	for(int i = 0; i < 2; ++i) {
+		size = align_up(size, BSP_DEFAULT_ALIGN) + counts->num_entities * sizeof(uint32_t);
+		size = align_up(size, BSP_DEFAULT_ALIGN) + counts->num_entities * sizeof(const char*);
+	}
+	if(flags & BSP_LOAD_ENTITY_FIELDS) {
+		/* origin, angles, light, spawnflags, model, present */
+		static const size_t field_sizes[] = { 3 * sizeof(float), 3 * sizeof(float), sizeof(float), sizeof(int32_t), sizeof(int32_t), sizeof(uint32_t) };
+		for(size_t i = 0; i < sizeof(field_sizes) / sizeof(field_sizes[0]); ++i) {
+			size = align_up(size, BSP_CACHE_LINE) + counts->num_entities * field_sizes[i];
 		}
 	}
-	fprintf(stderr, "[BSP] Freeing entities\n");
-	bsp_free_ptr(bsp, bsp->entities);
-	bsp->entities = NULL;
-	bsp->num_entities = 0;
+	return size;
 }
 
+static size_t find_key(const bsp_t* bsp, uint32_t hash, const char* key) {
+	size_t mask = bsp->num_key_slots - 1;
+	for(size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+		uint32_t index = bsp->key_slots[slot];
+		if(!index) {
+			return (size_t)-1;
+		}
+		if(bsp->key_hashes[index - 1] == hash && strcmp(bsp->keys[index - 1], key) == 0) {
+			return index - 1;
+		}
+	}
+}
 
-static int read_planes(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
-	fprintf(stderr, "[BSP] Reading planes lump (offset=%d, length=%d)...\n", l->offset, l->length);
-	if(l->length <= 0) {
-		fprintf(stderr, "[BSP] Planes lump empty\n");
-		bsp->planes = NULL;
-		bsp->num_planes = 0;
-		return 1;
+/*
+Assigns every property a key id and points its key at the first occurrence of that key.
+property_slots is not in use yet and serves as the scratch table.
+*/
+static int intern_keys(bsp_t* bsp, bsp_source_t* src) {
+	uint32_t* scratch = bsp->property_slots;
+	size_t mask = bsp->num_property_slots - 1;
+	size_t num_keys = 0;
+	memset(scratch, 0, bsp->num_property_slots * sizeof(uint32_t));
+	for(size_t p = 0; p < bsp->num_properties; ++p) {
+		const char* key = bsp->properties[p].key;
+		for(size_t slot = bsp_key_hash(key) & mask;; slot = (slot + 1) & mask) {
+			if(!scratch[slot]) {
+				scratch[slot] = (uint32_t)(p + 1);
+				bsp->property_keys[p] = (uint32_t)num_keys++;
+				break;
+			}
+			size_t q = scratch[slot] - 1;
+			if(strcmp(bsp->properties[q].key, key) == 0) {
+				bsp->property_keys[p] = bsp->property_keys[q];
+				break;
+			}
+		}
 	}
-	if(!seek_lump(fp, l)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to seek to planes lump\n");
+
+	bsp->num_keys = num_keys;
+	bsp->num_key_slots = slot_count(num_keys);
+	bsp->keys = (const char**)alloc_array(bsp, src, num_keys, sizeof(const char*));
+	bsp->key_hashes = (uint32_t*)alloc_array(bsp, src, num_keys, sizeof(uint32_t));
+	bsp->key_slots = (uint32_t*)alloc_array(bsp, src, bsp->num_key_slots, sizeof(uint32_t));
+	if(!bsp->keys || !bsp->key_hashes || !bsp->key_slots) {
 		return 0;
 	}
-	size_t count = (size_t)l->length / sizeof(bsp_plane_t);
-	fprintf(stderr, "[BSP] Allocating %zu planes...\n", count);
-	bsp->planes = (bsp_plane_t*)alloc_array(bsp, count, sizeof(bsp_plane_t));
-	if(!bsp->planes && count) {
-		fprintf(stderr, "[BSP] ERROR: Failed to allocate planes array\n");
-		return 0;
+	size_t next = 0;
+	for(size_t p = 0; p < bsp->num_properties; ++p) {
+		uint32_t id = bsp->property_keys[p];
+		if(id == next) {
+			bsp->keys[next++] = bsp->properties[p].key;
+		}
+		bsp->properties[p].key = bsp->keys[id];
 	}
-	if(!read_exact(fp, bsp->planes, count * sizeof(bsp_plane_t))) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read planes data\n");
-		return 0;
+	mask = bsp->num_key_slots - 1;
+	memset(bsp->key_slots, 0, bsp->num_key_slots * sizeof(uint32_t));
+	for(size_t id = 0; id < num_keys; ++id) {
+		uint32_t hash = bsp_key_hash(bsp->keys[id]);
+		bsp->key_hashes[id] = hash;
+		size_t slot = hash & mask;
+		while(bsp->key_slots[slot]) {
+			slot = (slot + 1) & mask;
+		}
+		bsp->key_slots[slot] = (uint32_t)(id + 1);
 	}
-	bsp->num_planes = count;
-	fprintf(stderr, "[BSP] Planes loaded: %zu planes\n", count);
 	return 1;
 }
 
-static int read_miptex(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
-	fprintf(stderr, "[BSP] Reading miptex lump (offset=%d, length=%d)...\n", l->offset, l->length);
-	if(l->length <= 0) {
-		fprintf(stderr, "[BSP] Miptex lump empty\n");
-		bsp->miptex_raw = NULL;
-		bsp->miptex_raw_size = 0;
-		bsp->miptex_dir.nummiptex = 0;
-		bsp->miptex_dir.offsets = NULL;
-		bsp->miptex = NULL;
-		return 1;
+static const char* entity_property_id(const bsp_t* bsp, size_t entity_index, uint32_t key_id) {
+	const bsp_entity_t* ent = &bsp->entities[entity_index];
+	size_t first = (size_t)(ent->properties - bsp->properties);
+	size_t mask = bsp->num_property_slots - 1;
+	for(size_t slot = property_slot(entity_index, key_id, mask);; slot = (slot + 1) & mask) {
+		uint32_t index = bsp->property_slots[slot];
+		if(!index) {
+			return NULL;
+		}
+		size_t p = index - 1;
+		if(bsp->property_keys[p] == key_id && p - first < ent->num_properties) {
+			return bsp->properties[p].value;
+		}
 	}
-	if(!seek_lump(fp, l)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to seek to miptex lump\n");
-		return 0;
+}
+
+static int value_less(const value_index_t* index, size_t a, size_t b) {
+	int c = strcmp(index->values[a], index->values[b]);
+	return c < 0 || (c == 0 && index->entities[a] < index->entities[b]);
+}
+
+static void value_swap(value_index_t* index, size_t a, size_t b) {
+	uint32_t entity = index->entities[a];
+	const char* value = index->values[a];
+	index->entities[a] = index->entities[b];
+	index->values[a] = index->values[b];
+	index->entities[b] = entity;
+	index->values[b] = value;
+}
+
+static void value_sift_down(value_index_t* index, size_t root, size_t end) {
+	for(;;) {
+		size_t child = root * 2 + 1;
+		if(child >= end) {
+			return;
+		}
+		if(child + 1 < end && value_less(index, child, child + 1)) {
+			child++;
+		}
+		if(!value_less(index, root, child)) {
+			return;
+		}
+		value_swap(index, root, child);
+		root = child;
 	}
-	bsp->miptex_raw_size = (size_t)l->length;
-	fprintf(stderr, "[BSP] Allocating %zu bytes for miptex raw data...\n", bsp->miptex_raw_size);
-	bsp->miptex_raw = (uint8_t*)bsp_malloc(bsp, bsp->miptex_raw_size);
-	if(!bsp->miptex_raw) {
-		fprintf(stderr, "[BSP] ERROR: Failed to allocate miptex raw data\n");
-		return 0;
+}
+
+/* Heap sort, qsort cannot move the two parallel arrays together */
+static void sort_value_index(value_index_t* index) {
+	for(size_t i = index->count / 2; i-- > 0;) {
+		value_sift_down(index, i, index->count);
 	}
-	if(!read_exact(fp, bsp->miptex_raw, bsp->miptex_raw_size)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read miptex raw data\n");
-		return 0;
+	for(size_t end = index->count; end-- > 1;) {
+		value_swap(index, 0, end);
+		value_sift_down(index, 0, end);
 	}
+}
 
-	if(bsp->miptex_raw_size < (size_t)sizeof(int32_t)) {
-		return 0;
+static int build_value_index(bsp_t* bsp, bsp_source_t* src, const char* key, value_index_t* index) {
+	memset(index, 0, sizeof(*index));
+	size_t id = find_key(bsp, bsp_key_hash(key), key);
+	if(id == (size_t)-1) {
+		return 1;
 	}
-	const uint8_t* p = bsp->miptex_raw;
-	int32_t nummiptex = *(const int32_t*)p;
-	p += sizeof(int32_t);
-	fprintf(stderr, "[BSP] Miptex directory has %d entries\n", nummiptex);
-
-	size_t dir_size = sizeof(int32_t) + (size_t)nummiptex * sizeof(int32_t);
-	if(bsp->miptex_raw_size < dir_size) {
-		fprintf(stderr, "[BSP] ERROR: Miptex directory truncated (need %zu bytes, have %zu)\n", dir_size, bsp->miptex_raw_size);
-		return 0;
+	size_t count = 0;
+	for(size_t e = 0; e < bsp->num_entities; ++e) {
+		count += entity_property_id(bsp, e, (uint32_t)id) != NULL;
 	}
-
-	bsp->miptex_dir.nummiptex = nummiptex;
-	fprintf(stderr, "[BSP] Allocating miptex offset array...\n");
-	bsp->miptex_dir.offsets = (int32_t*)bsp_malloc(bsp, (size_t)nummiptex * sizeof(int32_t));
-	if(!bsp->miptex_dir.offsets && nummiptex) {
-		fprintf(stderr, "[BSP] ERROR: Failed to allocate miptex offsets\n");
+	index->count = count;
+	index->entities = (uint32_t*)alloc_array(bsp, src, count, sizeof(uint32_t));
+	index->values = (const char**)alloc_array(bsp, src, count, sizeof(const char*));
+	if(count && (!index->entities || !index->values)) {
 		return 0;
 	}
-	memcpy(bsp->miptex_dir.offsets, p, (size_t)nummiptex * sizeof(int32_t));
-
-	fprintf(stderr, "[BSP] Allocating miptex pointer array...\n");
-	bsp->miptex = (bsp_miptex_t**)bsp_calloc(bsp, (size_t)nummiptex, sizeof(bsp_miptex_t*));
-	if(!bsp->miptex && nummiptex) {
-		fprintf(stderr, "[BSP] ERROR: Failed to allocate miptex pointers\n");
-		return 0;
+	size_t n = 0;
+	for(size_t e = 0; e < bsp->num_entities; ++e) {
+		const char* value = entity_property_id(bsp, e, (uint32_t)id);
+		if(value) {
+			index->entities[n] = (uint32_t)e;
+			index->values[n] = value;
+			n++;
+		}
+	}
+	sort_value_index(index);
+	return 1;
+}
+
+static void free_value_index(bsp_t* bsp, value_index_t* index) {
+	free_array(bsp, index->entities, index->count, sizeof(uint32_t));
+	free_array(bsp, (void*)index->values, index->count, sizeof(const char*));
+	memset(index, 0, sizeof(*index));
+}
+
+static bsp_entity_span_t find_in_value_index(const value_index_t* index, const char* value) {
+	bsp_entity_span_t span = { NULL, 0 };
+	size_t lo = 0;
+	size_t hi = index->count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(strcmp(index->values[mid], value) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	size_t end = lo;
+	while(end < index->count && strcmp(index->values[end], value) == 0) {
+		end++;
+	}
+	if(end > lo) {
+		span.indices = index->entities + lo;
+		span.count = end - lo;
+	}
+	return span;
+}
+
+/* Properties are inserted in order, so probing finds the first of duplicate keys like the linear scan did */
+static void index_properties(bsp_t* bsp) {
+	size_t mask = bsp->num_property_slots - 1;
+	memset(bsp->property_slots, 0, bsp->num_property_slots * sizeof(uint32_t));
+	for(size_t e = 0; e < bsp->num_entities; ++e) {
+		const bsp_entity_t* ent = &bsp->entities[e];
+		size_t first = (size_t)(ent->properties - bsp->properties);
+		for(size_t i = 0; i < ent->num_properties; ++i) {
+			size_t slot = property_slot(e, bsp->property_keys[first + i], mask);
+			while(bsp->property_slots[slot]) {
+				slot = (slot + 1) & mask;
+			}
+			bsp->property_slots[slot] = (uint32_t)(first + i + 1);
+		}
+	}
+}
+
+/* Number parsing independent of the C locale, a host that sets LC_NUMERIC must not change what maps mean */
+static const char* parse_number(const char* p, double* out) {
+	while(is_space((unsigned char)*p)) {
+		p++;
+	}
+	int negative = *p == '-';
+	if(*p == '-' || *p == '+') {
+		p++;
+	}
+	double value = 0.0;
+	int digits = 0;
+	for(; *p >= '0' && *p <= '9'; ++p, ++digits) {
+		value = value * 10.0 + (*p - '0');
+	}
+	if(*p == '.') {
+		double scale = 0.1;
+		for(++p; *p >= '0' && *p <= '9'; ++p, ++digits) {
+			value += (*p - '0') * scale;
+			scale *= 0.1;
+		}
+	}
+	if(!digits) {
+		return NULL;
+	}
+	if(*p == 'e' || *p == 'E') {
+		const char* e = p + 1;
+		int exp_negative = *e == '-';
+		if(*e == '-' || *e == '+') {
+			e++;
+		}
+		if(*e >= '0' && *e <= '9') {
+			int exponent = 0;
+			for(; *e >= '0' && *e <= '9'; ++e) {
+				exponent = exponent < 1000 ? exponent * 10 + (*e - '0') : exponent;
+			}
+			while(exponent--) {
+				value = exp_negative ? value / 10.0 : value * 10.0;
+			}
+			p = e;
+		}
+	}
+	*out = negative ? -value : value;
+	return p;
+}
+
+/* Stores count numbers into out only when all of them parse */
+static int parse_floats(const char* p, float* out, int count) {
+	float values[3];
+	for(int i = 0; i < count; ++i) {
+		double value;
+		p = parse_number(p, &value);
+		if(!p) {
+			return 0;
+		}
+		/* Out of range conversions are undefined, clamp them to the largest float */
+		value = value > FLT_MAX ? FLT_MAX : value < -FLT_MAX ? -FLT_MAX : value;
+		values[i] = (float)value;
+	}
+	memcpy(out, values, (size_t)count * sizeof(float));
+	return 1;
+}
+
+/* Entity text is untrusted, numbers past the int32_t range are rejected instead of converted */
+static int number_to_int32(double value, int32_t* out) {
+	if(!(value >= (double)INT32_MIN && value <= (double)INT32_MAX)) {
+		return 0;
+	}
+	*out = (int32_t)value;
+	return 1;
+}
+
+/*
+BSP_LOAD_ENTITY_FIELDS: parses the commonly used values of every entity once, from the first
+occurrence of each key like bsp_entity_get_property. "angle" is the yaw when there is no "angles".
+*/
+static int build_entity_fields(bsp_t* bsp, bsp_source_t* src) {
+	bsp_entity_fields_t* f = &bsp->fields;
+	size_t n = bsp->num_entities;
+	f->count = n;
+	f->origin = (float*)lump_alloc(bsp, src, n * 3 * sizeof(float), BSP_CACHE_LINE);
+	f->angles = (float*)lump_alloc(bsp, src, n * 3 * sizeof(float), BSP_CACHE_LINE);
+	f->light = (float*)lump_alloc(bsp, src, n * sizeof(float), BSP_CACHE_LINE);
+	f->spawnflags = (int32_t*)lump_alloc(bsp, src, n * sizeof(int32_t), BSP_CACHE_LINE);
+	f->model = (int32_t*)lump_alloc(bsp, src, n * sizeof(int32_t), BSP_CACHE_LINE);
+	f->present = (uint32_t*)lump_alloc(bsp, src, n * sizeof(uint32_t), BSP_CACHE_LINE);
+	if(!f->origin || !f->angles || !f->light || !f->spawnflags || !f->model || !f->present) {
+		return 0;
+	}
+	memset(f->origin, 0, n * 3 * sizeof(float));
+	memset(f->angles, 0, n * 3 * sizeof(float));
+	memset(f->light, 0, n * sizeof(float));
+	memset(f->spawnflags, 0, n * sizeof(int32_t));
+	memset(f->present, 0, n * sizeof(uint32_t));
+
+	enum { ORIGIN, ANGLES, ANGLE, LIGHT, SPAWNFLAGS, MODEL, FIELD_KEYS };
+	static const char* const names[FIELD_KEYS] = { "origin", "angles", "angle", "light", "spawnflags", "model" };
+	size_t ids[FIELD_KEYS];
+	for(int k = 0; k < FIELD_KEYS; ++k) {
+		ids[k] = bsp->num_keys ? find_key(bsp, bsp_key_hash(names[k]), names[k]) : (size_t)-1;
+	}
+	for(size_t e = 0; e < n; ++e) {
+		const bsp_entity_t* ent = &bsp->entities[e];
+		size_t first = (size_t)(ent->properties - bsp->properties);
+		uint32_t present = 0;
+		int has_angles = 0;
+		f->model[e] = -1;
+		for(size_t i = 0; i < ent->num_properties; ++i) {
+			size_t id = bsp->property_keys[first + i];
+			const char* value = ent->properties[i].value;
+			double number;
+			if(id == ids[ORIGIN] && !(present & BSP_FIELD_ORIGIN)) {
+				present |= parse_floats(value, &f->origin[e * 3], 3) ? BSP_FIELD_ORIGIN : 0;
+			} else if(id == ids[ANGLES] && !has_angles) {
+				has_angles = 1;
+				/* "angles" overrides an earlier "angle", also when it is malformed */
+				if(parse_floats(value, &f->angles[e * 3], 3)) {
+					present |= BSP_FIELD_ANGLES;
+				} else {
+					memset(&f->angles[e * 3], 0, 3 * sizeof(float));
+					present &= ~(uint32_t)BSP_FIELD_ANGLES;
+				}
+			} else if(id == ids[ANGLE] && !has_angles && !(present & BSP_FIELD_ANGLES)) {
+				if(parse_floats(value, &f->angles[e * 3 + 1], 1)) {
+					present |= BSP_FIELD_ANGLES;
+				}
+			} else if(id == ids[LIGHT] && !(present & BSP_FIELD_LIGHT)) {
+				present |= parse_floats(value, &f->light[e], 1) ? BSP_FIELD_LIGHT : 0;
+			} else if(id == ids[SPAWNFLAGS] && !(present & BSP_FIELD_SPAWNFLAGS)) {
+				if(parse_number(value, &number) && number_to_int32(number, &f->spawnflags[e])) {
+					present |= BSP_FIELD_SPAWNFLAGS;
+				}
+			} else if(id == ids[MODEL] && !(present & BSP_FIELD_MODEL) && value[0] == '*') {
+				if(parse_number(value + 1, &number) && number >= 0 && number_to_int32(number, &f->model[e])) {
+					present |= BSP_FIELD_MODEL;
+				}
+			}
+		}
+		f->present[e] = present;
+	}
+	return 1;
+}
+
+static void free_entity_fields(bsp_t* bsp) {
+	bsp_entity_fields_t* f = &bsp->fields;
+	size_t n = f->count;
+	bsp_free_ptr(bsp, f->origin, n * 3 * sizeof(float));
+	bsp_free_ptr(bsp, f->angles, n * 3 * sizeof(float));
+	bsp_free_ptr(bsp, f->light, n * sizeof(float));
+	bsp_free_ptr(bsp, f->spawnflags, n * sizeof(int32_t));
+	bsp_free_ptr(bsp, f->model, n * sizeof(int32_t));
+	bsp_free_ptr(bsp, f->present, n * sizeof(uint32_t));
+	memset(f, 0, sizeof(*f));
+}
+
+static int read_entities(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
+	BSP_DEBUG("Reading entities lump (offset=%d, length=%d)...", l->offset, l->length);
+	if(l->length <= 0) {
+		BSP_DEBUG("Entities lump empty");
+		bsp->entities = NULL;
+		bsp->num_entities = 0;
+		return 1;
+	}
+	/* The text stays alive as the storage of every key and value. It may have been read ahead by create_arena. */
+	if(!src->text_read) {
+		if(!check_lump(src, l)) {
+			BSP_ERROR("Invalid entities lump");
+			return 0;
+		}
+		bsp->entity_text = read_lump_text(bsp, src, l);
+		bsp->entity_text_size = (size_t)l->length + 1 + BSP_TEXT_PAD;
+	}
+	if(!bsp->entity_text) {
+		BSP_ERROR("Failed to read entities text");
+		return 0;
+	}
+	entity_counts_t counts;
+	walk_entities(bsp->entity_text, &counts, NULL, NULL);
+
+	/* Sizes are set with the pointers so free_entities can release a partial load */
+	bsp->num_entities = counts.num_entities;
+	bsp->num_properties = counts.num_properties;
+	bsp->num_property_slots = slot_count(counts.num_properties);
+	bsp->entities = (bsp_entity_t*)alloc_array(bsp, src, counts.num_entities, sizeof(bsp_entity_t));
+	bsp->properties = (bsp_property_t*)alloc_array(bsp, src, counts.num_properties, sizeof(bsp_property_t));
+	bsp->property_keys = (uint32_t*)alloc_array(bsp, src, counts.num_properties, sizeof(uint32_t));
+	bsp->property_slots = (uint32_t*)alloc_array(bsp, src, bsp->num_property_slots, sizeof(uint32_t));
+	if((!bsp->entities && counts.num_entities) || (counts.num_properties && (!bsp->properties || !bsp->property_keys || !bsp->property_slots))) {
+		BSP_ERROR("Failed to allocate entities");
+		return 0;
+	}
+	if(src->region.base && !in_block(bsp->entity_text, bsp->arena, bsp->arena_size)) {
+		/* Read ahead before the arena existed, move it behind the tables */
+		char* text = (char*)lump_alloc(bsp, src, bsp->entity_text_size, 1);
+		if(!text) {
+			BSP_ERROR("Failed to allocate entities text");
+			return 0;
+		}
+		memcpy(text, bsp->entity_text, bsp->entity_text_size);
+		bsp_free_ptr(bsp, bsp->entity_text, bsp->entity_text_size);
+		bsp->entity_text = text;
+	}
+
+	walk_entities(bsp->entity_text, &counts, bsp->entities, bsp->properties);
+	if(counts.num_properties) {
+		if(!intern_keys(bsp, src)) {
+			BSP_ERROR("Failed to allocate entity keys");
+			return 0;
+		}
+		index_properties(bsp);
+		if(!build_value_index(bsp, src, "classname", &bsp->classnames) || !build_value_index(bsp, src, "targetname", &bsp->targetnames)) {
+			BSP_ERROR("Failed to allocate entity indices");
+			return 0;
+		}
+	}
+	if((src->flags & BSP_LOAD_ENTITY_FIELDS) && counts.num_entities && !build_entity_fields(bsp, src)) {
+		BSP_ERROR("Failed to allocate entity fields");
+		return 0;
+	}
+	BSP_DEBUG("Entities loaded: %zu entities", counts.num_entities);
+	return 1;
+}
+
+void free_entities(bsp_t* bsp) {
+	if(!bsp) {
+		return;
+	}
+	free_entity_fields(bsp);
+	free_value_index(bsp, &bsp->classnames);
+	free_value_index(bsp, &bsp->targetnames);
+	BSP_DEBUG("Freeing properties");
+	free_array(bsp, bsp->key_slots, bsp->num_key_slots, sizeof(uint32_t));
+	free_array(bsp, bsp->key_hashes, bsp->num_keys, sizeof(uint32_t));
+	free_array(bsp, (void*)bsp->keys, bsp->num_keys, sizeof(const char*));
+	free_array(bsp, bsp->property_slots, bsp->num_property_slots, sizeof(uint32_t));
+	free_array(bsp, bsp->property_keys, bsp->num_properties, sizeof(uint32_t));
+	free_array(bsp, bsp->properties, bsp->num_properties, sizeof(bsp_property_t));
+	BSP_DEBUG("Freeing entities");
+	free_array(bsp, bsp->entities, bsp->num_entities, sizeof(bsp_entity_t));
+	bsp_free_ptr(bsp, bsp->entity_text, bsp->entity_text_size);
+	bsp->entities = NULL;
+	bsp->num_entities = 0;
+	bsp->properties = NULL;
+	bsp->num_properties = 0;
+	bsp->property_keys = NULL;
+	bsp->property_slots = NULL;
+	bsp->num_property_slots = 0;
+	bsp->keys = NULL;
+	bsp->key_hashes = NULL;
+	bsp->num_keys = 0;
+	bsp->key_slots = NULL;
+	bsp->num_key_slots = 0;
+	bsp->entity_text = NULL;
+	bsp->entity_text_size = 0;
+}
+
+
+static int read_planes(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
+	BSP_DEBUG("Reading planes lump (offset=%d, length=%d)...", l->offset, l->length);
+	if(l->length <= 0) {
+		BSP_DEBUG("Planes lump empty");
+		bsp->planes = NULL;
+		bsp->num_planes = 0;
+		return 1;
+	}
+	if(!check_lump(src, l)) {
+		BSP_ERROR("Invalid planes lump");
+		return 0;
+	}
+	size_t count = (size_t)l->length / sizeof(bsp_plane_t);
+	BSP_DEBUG("Allocating %zu planes...", count);
+	bsp->planes = (bsp_plane_t*)fetch_lump(bsp, src, l, count, LUMP_PLANES);
+	if(!bsp->planes && count) {
+		BSP_ERROR("Failed to read planes data");
+		return 0;
+	}
+	bsp->num_planes = count;
+	BSP_DEBUG("Planes loaded: %zu planes", count);
+	return 1;
+}
+
+static int read_miptex(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
+	BSP_DEBUG("Reading miptex lump (offset=%d, length=%d)...", l->offset, l->length);
+	if(l->length <= 0) {
+		BSP_DEBUG("Miptex lump empty");
+		bsp->miptex_raw = NULL;
+		bsp->miptex_raw_size = 0;
+		bsp->miptex_dir.nummiptex = 0;
+		bsp->miptex_dir.offsets = NULL;
+		bsp->miptex = NULL;
+		return 1;
+	}
+	if(!check_lump(src, l)) {
+		BSP_ERROR("Invalid miptex lump");
+		return 0;
+	}
+	bsp->miptex_raw_size = (size_t)l->length;
+	BSP_DEBUG("Allocating %zu bytes for miptex raw data...", bsp->miptex_raw_size);
+	bsp->miptex_raw = (uint8_t*)fetch_lump(bsp, src, l, bsp->miptex_raw_size, LUMP_MIPTEX);
+	if(!bsp->miptex_raw) {
+		BSP_ERROR("Failed to read miptex raw data");
+		return 0;
+	}
+
+	if(bsp->miptex_raw_size < (size_t)sizeof(int32_t)) {
+		return 0;
+	}
+	const uint8_t* p = bsp->miptex_raw;
+	int32_t nummiptex = *(const int32_t*)p;
+	p += sizeof(int32_t);
+	BSP_DEBUG("Miptex directory has %d entries", nummiptex);
+
+	size_t dir_size = sizeof(int32_t) + (size_t)nummiptex * sizeof(int32_t);
+	if(bsp->miptex_raw_size < dir_size) {
+		BSP_ERROR("Miptex directory truncated (need %zu bytes, have %zu)", dir_size, bsp->miptex_raw_size);
+		return 0;
+	}
+
+	bsp->miptex_dir.nummiptex = nummiptex;
+	if(!nummiptex) {
+		return 1;
+	}
+	BSP_DEBUG("Allocating miptex offset array...");
+	bsp->miptex_dir.offsets = (int32_t*)lump_alloc(bsp, src, (size_t)nummiptex * sizeof(int32_t), BSP_DEFAULT_ALIGN);
+	if(!bsp->miptex_dir.offsets) {
+		BSP_ERROR("Failed to allocate miptex offsets");
+		return 0;
+	}
+	memcpy(bsp->miptex_dir.offsets, p, (size_t)nummiptex * sizeof(int32_t));
+
+	BSP_DEBUG("Allocating miptex pointer array...");
+	bsp->miptex = (bsp_miptex_t**)lump_calloc(bsp, src, (size_t)nummiptex, sizeof(bsp_miptex_t*));
+	if(!bsp->miptex) {
+		BSP_ERROR("Failed to allocate miptex pointers");
+		return 0;
 	}
 
 	for(int32_t i = 0; i < nummiptex; ++i) {
 		int32_t off = bsp->miptex_dir.offsets[i];
 		if(off <= 0) {
-			fprintf(stderr, "[BSP] Miptex %d: not present (offset=%d)\n", i, off);
+			BSP_DEBUG("Miptex %d: not present (offset=%d)", i, off);
 			bsp->miptex[i] = NULL;
 			continue;
 		}
 		if((size_t)off >= bsp->miptex_raw_size) {
-			fprintf(stderr, "[BSP] ERROR: Miptex %d offset out of range: %d (raw size=%zu)\n", i, off, bsp->miptex_raw_size);
+			BSP_WARN("Miptex %d offset out of range: %d (raw size=%zu)", i, off, bsp->miptex_raw_size);
 			bsp->miptex[i] = NULL;
 			continue;
 		}
 		if((size_t)off + sizeof(bsp_miptex_t) > bsp->miptex_raw_size) {
-			fprintf(stderr, "[BSP] ERROR: Miptex %d struct truncated at offset %d\n", i, off);
+			BSP_WARN("Miptex %d struct truncated at offset %d", i, off);
 			bsp->miptex[i] = NULL;
 			continue;
 		}
 		bsp->miptex[i] = (bsp_miptex_t*)(bsp->miptex_raw + off);
-		fprintf(stderr, "[BSP] Miptex %d loaded at offset %d\n", i, off);
+		BSP_DEBUG("Miptex %d loaded at offset %d", i, off);
 	}
-	fprintf(stderr, "[BSP] Miptex lump loaded: %d textures\n", nummiptex);
+	BSP_DEBUG("Miptex lump loaded: %d textures", nummiptex);
 	return 1;
 }
 
-static int read_vertices(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
-	fprintf(stderr, "[BSP] Reading vertices lump (offset=%d, length=%d)...\n", l->offset, l->length);
+static int read_vertices(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
+	BSP_DEBUG("Reading vertices lump (offset=%d, length=%d)...", l->offset, l->length);
 	if(l->length <= 0) {
-		fprintf(stderr, "[BSP] Vertices lump empty\n");
+		BSP_DEBUG("Vertices lump empty");
 		bsp->vertices = NULL;
 		bsp->num_vertices = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to seek to vertices lump\n");
+	if(!check_lump(src, l)) {
+		BSP_ERROR("Invalid vertices lump");
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_vertex_t);
-	fprintf(stderr, "[BSP] Allocating %zu vertices...\n", count);
-	bsp->vertices = (bsp_vertex_t*)alloc_array(bsp, count, sizeof(bsp_vertex_t));
+	BSP_DEBUG("Allocating %zu vertices...", count);
+	bsp->vertices = (bsp_vertex_t*)fetch_lump(bsp, src, l, count, LUMP_VERTICES);
 	if(!bsp->vertices && count) {
-		fprintf(stderr, "[BSP] ERROR: Failed to allocate vertices array\n");
-		return 0;
-	}
-	if(!read_exact(fp, bsp->vertices, count * sizeof(bsp_vertex_t))) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read vertices data\n");
+		BSP_ERROR("Failed to read vertices data");
 		return 0;
 	}
 	bsp->num_vertices = count;
-	fprintf(stderr, "[BSP] Vertices loaded: %zu vertices\n", count);
+	BSP_DEBUG("Vertices loaded: %zu vertices", count);
 	return 1;
 }
 
-static int read_visdata(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_visdata(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->visdata.data = NULL;
 		bsp->visdata.size = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	bsp->visdata.size = (size_t)l->length;
-	bsp->visdata.data = (uint8_t*)bsp_malloc(bsp, bsp->visdata.size);
-	if(!bsp->visdata.data && l->length) {
-		return 0;
-	}
-	if(!read_exact(fp, bsp->visdata.data, bsp->visdata.size)) {
+	bsp->visdata.data = (uint8_t*)fetch_lump(bsp, src, l, bsp->visdata.size, LUMP_VISDATA);
+	if(!bsp->visdata.data) {
 		return 0;
 	}
 	return 1;
 }
 
-static int read_nodes(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_nodes(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->nodes = NULL;
 		bsp->num_nodes = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_node_t);
-	bsp->nodes = (bsp_node_t*)alloc_array(bsp, count, sizeof(bsp_node_t));
+	bsp->nodes = (bsp_node_t*)fetch_lump(bsp, src, l, count, LUMP_NODES);
 	if(!bsp->nodes && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->nodes, count * sizeof(bsp_node_t))) {
-		return 0;
-	}
 	bsp->num_nodes = count;
 	return 1;
 }
 
-static int read_texinfo(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_texinfo(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->texinfo = NULL;
 		bsp->num_texinfo = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_texinfo_t);
-	bsp->texinfo = (bsp_texinfo_t*)alloc_array(bsp, count, sizeof(bsp_texinfo_t));
+	bsp->texinfo = (bsp_texinfo_t*)fetch_lump(bsp, src, l, count, LUMP_TEXINFO);
 	if(!bsp->texinfo && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->texinfo, count * sizeof(bsp_texinfo_t))) {
-		return 0;
-	}
 	bsp->num_texinfo = count;
 	return 1;
 }
 
-static int read_faces(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
-	fprintf(stderr, "[BSP] Reading faces lump (offset=%d, length=%d)...\n", l->offset, l->length);
+static int read_faces(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
+	BSP_DEBUG("Reading faces lump (offset=%d, length=%d)...", l->offset, l->length);
 	if(l->length <= 0) {
-		fprintf(stderr, "[BSP] Faces lump empty\n");
+		BSP_DEBUG("Faces lump empty");
 		bsp->faces = NULL;
 		bsp->num_faces = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to seek to faces lump\n");
+	if(!check_lump(src, l)) {
+		BSP_ERROR("Invalid faces lump");
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_face_t);
-	fprintf(stderr, "[BSP] Allocating %zu faces...\n", count);
-	bsp->faces = (bsp_face_t*)alloc_array(bsp, count, sizeof(bsp_face_t));
+	BSP_DEBUG("Allocating %zu faces...", count);
+	bsp->faces = (bsp_face_t*)fetch_lump(bsp, src, l, count, LUMP_FACES);
 	if(!bsp->faces && count) {
-		fprintf(stderr, "[BSP] ERROR: Failed to allocate faces array\n");
-		return 0;
-	}
-	if(!read_exact(fp, bsp->faces, count * sizeof(bsp_face_t))) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read faces data\n");
+		BSP_ERROR("Failed to read faces data");
 		return 0;
 	}
 	bsp->num_faces = count;
-	fprintf(stderr, "[BSP] Faces loaded: %zu faces\n", count);
+	BSP_DEBUG("Faces loaded: %zu faces", count);
 	return 1;
 }
 
-static int read_lighting(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_lighting(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->lighting.data = NULL;
 		bsp->lighting.size = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	bsp->lighting.size = (size_t)l->length;
-	bsp->lighting.data = (uint8_t*)bsp_malloc(bsp, bsp->lighting.size);
-	if(!bsp->lighting.data && l->length) {
-		return 0;
-	}
-	if(!read_exact(fp, bsp->lighting.data, bsp->lighting.size)) {
+	bsp->lighting.data = (uint8_t*)fetch_lump(bsp, src, l, bsp->lighting.size, LUMP_LIGHTING);
+	if(!bsp->lighting.data) {
 		return 0;
 	}
 	return 1;
 }
 
-static int read_clipnodes(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_clipnodes(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->clipnodes = NULL;
 		bsp->num_clipnodes = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_clipnode_t);
-	bsp->clipnodes = (bsp_clipnode_t*)alloc_array(bsp, count, sizeof(bsp_clipnode_t));
+	bsp->clipnodes = (bsp_clipnode_t*)fetch_lump(bsp, src, l, count, LUMP_CLIPNODES);
 	if(!bsp->clipnodes && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->clipnodes, count * sizeof(bsp_clipnode_t))) {
-		return 0;
-	}
 	bsp->num_clipnodes = count;
 	return 1;
 }
 
-static int read_leaves(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_leaves(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->leaves = NULL;
 		bsp->num_leaves = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_leaf_t);
-	bsp->leaves = (bsp_leaf_t*)alloc_array(bsp, count, sizeof(bsp_leaf_t));
+	bsp->leaves = (bsp_leaf_t*)fetch_lump(bsp, src, l, count, LUMP_LEAVES);
 	if(!bsp->leaves && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->leaves, count * sizeof(bsp_leaf_t))) {
-		return 0;
-	}
 	bsp->num_leaves = count;
 	return 1;
 }
 
-static int read_facelists(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_facelists(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->facelist.indices = NULL;
 		bsp->facelist.count = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(int16_t);
-	bsp->facelist.indices = (int16_t*)alloc_array(bsp, count, sizeof(int16_t));
+	bsp->facelist.indices = (int16_t*)fetch_lump(bsp, src, l, count, LUMP_FACELISTS);
 	if(!bsp->facelist.indices && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->facelist.indices, count * sizeof(int16_t))) {
-		return 0;
-	}
 	bsp->facelist.count = count;
 	return 1;
 }
 
-static int read_edges(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_edges(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->edges = NULL;
 		bsp->num_edges = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_edge_t);
-	bsp->edges = (bsp_edge_t*)alloc_array(bsp, count, sizeof(bsp_edge_t));
+	bsp->edges = (bsp_edge_t*)fetch_lump(bsp, src, l, count, LUMP_EDGES);
 	if(!bsp->edges && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->edges, count * sizeof(bsp_edge_t))) {
-		return 0;
-	}
 	bsp->num_edges = count;
 	return 1;
 }
 
-static int read_surfedges(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_surfedges(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->surfedges.indices = NULL;
 		bsp->surfedges.count = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(int32_t);
-	bsp->surfedges.indices = (int32_t*)alloc_array(bsp, count, sizeof(int32_t));
+	bsp->surfedges.indices = (int32_t*)fetch_lump(bsp, src, l, count, LUMP_SURFEDGES);
 	if(!bsp->surfedges.indices && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->surfedges.indices, count * sizeof(int32_t))) {
-		return 0;
-	}
 	bsp->surfedges.count = count;
 	return 1;
 }
 
-static int read_models(FILE* fp, const bsp_lump_t* l, bsp_t* bsp) {
+static int read_models(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp) {
 	if(l->length <= 0) {
 		bsp->models = NULL;
 		bsp->num_models = 0;
 		return 1;
 	}
-	if(!seek_lump(fp, l)) {
+	if(!check_lump(src, l)) {
 		return 0;
 	}
 	size_t count = (size_t)l->length / sizeof(bsp_model_t);
-	bsp->models = (bsp_model_t*)alloc_array(bsp, count, sizeof(bsp_model_t));
+	bsp->models = (bsp_model_t*)fetch_lump(bsp, src, l, count, LUMP_MODELS);
 	if(!bsp->models && count) {
 		return 0;
 	}
-	if(!read_exact(fp, bsp->models, count * sizeof(bsp_model_t))) {
-		return 0;
-	}
 	bsp->num_models = count;
 	return 1;
 }
 
+/* Copy-on-write mapping: the lumps handed out as mutable can be written without touching the file */
+static void* map_file(const char* path, size_t* size) {
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart <= 0 || (unsigned long long)file_size.QuadPart > (size_t)-1) {
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if(!mapping) {
+		return NULL;
+	}
+	void* base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+	if(!base) {
+		return NULL;
+	}
+	*size = (size_t)file_size.QuadPart;
+	return base;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+	void* base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+	return base;
+#endif
+}
+
+static void unmap_file(void* base, size_t size) {
+	if(!base) {
+		return;
+	}
+#if defined(_WIN32)
+	(void)size;
+	UnmapViewOfFile(base);
+#else
+	munmap(base, size);
+#endif
+}
+
+static void free_pvs_cache(bsp_t* bsp);
+static void free_pas(bsp_t* bsp);
+
 static void bsp_cleanup(bsp_t* bsp) {
 	if(!bsp) {
 		return;
 	}
+	free_pvs_cache(bsp);
+	free_pas(bsp);
+	if(bsp->pvs_matrix) {
+		bsp_heap_free(bsp, bsp->pvs_matrix, bsp->pvs_matrix_size);
+	}
 	free_entities(bsp);
-	bsp_free_ptr(bsp, bsp->planes);
-	bsp_free_ptr(bsp, bsp->miptex_raw);
-	bsp_free_ptr(bsp, bsp->miptex_dir.offsets);
-	bsp_free_ptr(bsp, bsp->miptex);
-	bsp_free_ptr(bsp, bsp->vertices);
-	bsp_free_ptr(bsp, bsp->visdata.data);
-	bsp_free_ptr(bsp, bsp->nodes);
-	bsp_free_ptr(bsp, bsp->texinfo);
-	bsp_free_ptr(bsp, bsp->faces);
-	bsp_free_ptr(bsp, bsp->lighting.data);
-	bsp_free_ptr(bsp, bsp->clipnodes);
-	bsp_free_ptr(bsp, bsp->leaves);
-	bsp_free_ptr(bsp, bsp->facelist.indices);
-	bsp_free_ptr(bsp, bsp->edges);
-	bsp_free_ptr(bsp, bsp->surfedges.indices);
-	bsp_free_ptr(bsp, bsp->models);
+	free_array(bsp, bsp->planes, bsp->num_planes, sizeof(bsp_plane_t));
+	bsp_free_ptr(bsp, bsp->miptex_raw, bsp->miptex_raw_size);
+	free_array(bsp, bsp->miptex_dir.offsets, (size_t)bsp->miptex_dir.nummiptex, sizeof(int32_t));
+	free_array(bsp, bsp->miptex, (size_t)bsp->miptex_dir.nummiptex, sizeof(bsp_miptex_t*));
+	free_array(bsp, bsp->vertices, bsp->num_vertices, sizeof(bsp_vertex_t));
+	bsp_free_ptr(bsp, bsp->visdata.data, bsp->visdata.size);
+	free_array(bsp, bsp->nodes, bsp->num_nodes, sizeof(bsp_node_t));
+	free_array(bsp, bsp->texinfo, bsp->num_texinfo, sizeof(bsp_texinfo_t));
+	free_array(bsp, bsp->faces, bsp->num_faces, sizeof(bsp_face_t));
+	bsp_free_ptr(bsp, bsp->lighting.data, bsp->lighting.size);
+	free_array(bsp, bsp->clipnodes, bsp->num_clipnodes, sizeof(bsp_clipnode_t));
+	free_array(bsp, bsp->leaves, bsp->num_leaves, sizeof(bsp_leaf_t));
+	free_array(bsp, bsp->facelist.indices, bsp->facelist.count, sizeof(int16_t));
+	free_array(bsp, bsp->edges, bsp->num_edges, sizeof(bsp_edge_t));
+	free_array(bsp, bsp->surfedges.indices, bsp->surfedges.count, sizeof(int32_t));
+	free_array(bsp, bsp->models, bsp->num_models, sizeof(bsp_model_t));
+	unmap_file(bsp->mapping, bsp->mapping_size);
+	if(bsp->arena) {
+		bsp_heap_free(bsp, bsp->arena, bsp->arena_size);
+	}
+
+	bsp_allocator_t allocator = bsp->allocator;
+	plain_fns_t plain = bsp->plain;
+	int load_flags = bsp->load_flags;
+	size_t pvs_cache_rows = bsp->pvs_cache_rows;
+	/* async is never written here, the loader thread runs this while the caller's thread reads it */
+	size_t async_at = offsetof(bsp_t, async);
+	memset(bsp, 0, async_at);
+	memset((uint8_t*)bsp + async_at + sizeof(bsp->async), 0, sizeof(*bsp) - async_at - sizeof(bsp->async));
+	bsp->allocator = allocator;
+	bsp->plain = plain;
+	bsp->load_flags = load_flags;
+	bsp->pvs_cache_rows = pvs_cache_rows;
+}
+
+/*
+bsp_create: plain malloc-style functions know nothing of alignment. Each block is allocated align bytes
+larger and the pointer rounded up within it, the block start is kept in the pointer-sized slot below.
+*/
+static void* aligned_plain_alloc(bsp_alloc_fn alloc, size_t size, size_t align) {
+	align = align < sizeof(void*) ? sizeof(void*) : align;
+	if(size > (size_t)-1 - align - sizeof(void*)) {
+		return NULL;
+	}
+	uint8_t* block = (uint8_t*)alloc(size + align + sizeof(void*));
+	if(!block) {
+		return NULL;
+	}
+	uint8_t* p = (uint8_t*)(((uintptr_t)block + sizeof(void*) + align - 1) & ~(uintptr_t)(align - 1));
+	memcpy(p - sizeof(void*), &block, sizeof(block));
+	return p;
+}
+
+static void aligned_plain_free(bsp_free_fn free, void* ptr) {
+	if(!ptr) {
+		return;
+	}
+	void* block;
+	memcpy(&block, (uint8_t*)ptr - sizeof(void*), sizeof(block));
+	free(block);
+}
+
+static void* plain_alloc(void* ctx, size_t size, size_t align) {
+	return aligned_plain_alloc(((plain_fns_t*)ctx)->alloc, size, align);
+}
+
+static void plain_free(void* ctx, void* ptr, size_t size) {
+	(void)size;
+	aligned_plain_free(((plain_fns_t*)ctx)->free, ptr);
+}
+
+/* bsp_create_ex(NULL): the system allocator */
+static void* system_alloc(void* ctx, size_t size, size_t align) {
+	(void)ctx;
+#if defined(_WIN32)
+	return _aligned_malloc(size ? size : 1, align);
+#else
+	if(align <= BSP_DEFAULT_ALIGN) {
+		return malloc(size ? size : 1);
+	}
+	void* p;
+	return posix_memalign(&p, align, size ? size : 1) == 0 ? p : NULL;
+#endif
+}
+
+static void* system_realloc(void* ctx, void* ptr, size_t old_size, size_t size, size_t align) {
+	(void)ctx;
+#if defined(_WIN32)
+	(void)old_size;
+	return _aligned_realloc(ptr, size ? size : 1, align);
+#else
+	if(align <= BSP_DEFAULT_ALIGN) {
+		return realloc(ptr, size ? size : 1);
+	}
+	/* realloc may move the block to a lesser alignment */
+	void* p;
+	if(posix_memalign(&p, align, size ? size : 1) != 0) {
+		return NULL;
+	}
+	memcpy(p, ptr, old_size < size ? old_size : size);
+	free(ptr);
+	return p;
+#endif
+}
+
+static void system_free(void* ctx, void* ptr, size_t size) {
+	(void)ctx;
+	(void)size;
+#if defined(_WIN32)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
 }
 
 bsp_t* bsp_create(const bsp_alloc_fn alloc, const bsp_free_fn free) {
 	bsp_t* bsp;
-	bsp = (bsp_t*)alloc(sizeof(bsp_t));
+	bsp = (bsp_t*)aligned_plain_alloc(alloc, sizeof(bsp_t), BSP_ALIGNOF(bsp_t));
+	if(!bsp) {
+		return NULL;
+	}
+	memset(bsp, 0, sizeof(*bsp));
+	bsp->plain.alloc = alloc;
+	bsp->plain.free = free;
+	bsp->allocator.alloc = plain_alloc;
+	bsp->allocator.free = plain_free;
+	bsp->allocator.ctx = &bsp->plain;
+	return bsp;
+}
+
+bsp_t* bsp_create_ex(const bsp_allocator_t* allocator) {
+	bsp_allocator_t a;
+	if(allocator) {
+		a = *allocator;
+	} else {
+		memset(&a, 0, sizeof(a));
+		a.alloc = system_alloc;
+		a.realloc = system_realloc;
+		a.free = system_free;
+	}
+	if(!a.alloc || !a.free) {
+		return NULL;
+	}
+	bsp_t* bsp = (bsp_t*)a.alloc(a.ctx, sizeof(bsp_t), BSP_ALIGNOF(bsp_t));
 	if(!bsp) {
 		return NULL;
 	}
 	memset(bsp, 0, sizeof(*bsp));
-	bsp->alloc = alloc;
-	bsp->free = free;
+	bsp->allocator = a;
 	return bsp;
 }
 
+void bsp_set_log_callback(int level, bsp_log_fn fn, void* ctx) {
+	log_sink.level = level;
+	log_sink.fn = fn;
+	log_sink.ctx = ctx;
+}
+
+void bsp_set_load_flags(bsp_t* bsp, int flags) {
+	if(bsp) {
+		bsp->load_flags = flags;
+	}
+}
+
+static void release_async(bsp_t* bsp);
+
 void bsp_destroy(bsp_t* bsp) {
 	if(!bsp) {
 		return;
 	}
+	release_async(bsp);
 	bsp_cleanup(bsp);
-	bsp->free(bsp);
+	bsp_allocator_t allocator = bsp->allocator;
+	allocator.free(allocator.ctx, bsp, sizeof(bsp_t));
 }
 
-int bsp_load_file(bsp_t* out, FILE* fp) {
-	fprintf(stderr, "[BSP] Starting BSP file load...\n");
-	if(!out || !fp) {
-		fprintf(stderr, "[BSP] ERROR: Invalid arguments to bsp_load_file\n");
-		return 0;
-	}
-	if(!read_header(fp, &out->header)) {
-		fprintf(stderr, "[BSP] ERROR: Failed to read BSP header\n");
+static int peek_lump(bsp_source_t* src, const bsp_lump_t* l, void* buf, size_t size) {
+	if((size_t)l->length < size || !check_lump(src, l)) {
 		return 0;
 	}
+	return read_at(src, (size_t)l->offset, buf, size);
+}
 
-	if(!read_entities(fp, &out->header.lumps[LUMP_ENTITIES], out)) {
-		bsp_cleanup(out);
-		return 0;
+/*
+Sizes the arena from the header so every requested lump that is not borrowed from the image, the miptex
+directory and the entity tables and text fit in one allocation. The entity text has to be scanned for
+that, it is kept in entity_text for read_entities. A lazy load reads nothing past the header here, the
+entities and the miptex tables then come from the heap when first used.
+Each lump gets its own cache line aligned region, which lets lumps load in any order and in parallel.
+*/
+static int create_arena(bsp_t* bsp, bsp_source_t* src, uint32_t lump_mask) {
+	size_t sizes[BSP_LUMP_COUNT] = { 0 };
+	const bsp_lump_t* l = &bsp->header.lumps[LUMP_ENTITIES];
+	if(l->length > 0 && (lump_mask & BSP_LUMP_ENTITIES) && !(src->flags & BSP_LOAD_LAZY)) {
+		if(!check_lump(src, l)) {
+			return 0;
+		}
+		bsp->entity_text = read_lump_text(bsp, src, l);
+		if(!bsp->entity_text) {
+			return 0;
+		}
+		bsp->entity_text_size = (size_t)l->length + 1 + BSP_TEXT_PAD;
+		src->text_read = 1;
+		entity_counts_t counts;
+		walk_entities(bsp->entity_text, &counts, NULL, NULL);
+		sizes[LUMP_ENTITIES] = entity_region_size(&counts, bsp->entity_text_size, src->flags);
 	}
-	if(!read_planes(fp, &out->header.lumps[LUMP_PLANES], out)) {
-		bsp_cleanup(out);
-		return 0;
+	for(int i = LUMP_ENTITIES + 1; i < BSP_LUMP_COUNT; ++i) {
+		l = &bsp->header.lumps[i];
+		if(l->length <= 0 || l->offset < 0 || !(lump_mask & (1u << i))) {
+			continue;
+		}
+		size_t size = 0;
+		int borrowed = src->data && (src->flags & BSP_LOAD_BORROW) && ((uintptr_t)(src->data + l->offset) & (lump_layout[i].align - 1)) == 0;
+		if(!borrowed) {
+			size = (size_t)l->length / lump_layout[i].size * lump_layout[i].size;
+		}
+		int32_t nummiptex;
+		if(i == LUMP_MIPTEX && !(src->flags & BSP_LOAD_LAZY) && peek_lump(src, l, &nummiptex, sizeof(nummiptex)) && nummiptex > 0) {
+			size = align_up(size, BSP_DEFAULT_ALIGN) + (size_t)nummiptex * sizeof(int32_t);
+			size = align_up(size, BSP_DEFAULT_ALIGN) + (size_t)nummiptex * sizeof(bsp_miptex_t*);
+		}
+		sizes[i] = size;
 	}
-	if(!read_miptex(fp, &out->header.lumps[LUMP_MIPTEX], out)) {
-		bsp_cleanup(out);
-		return 0;
+	size_t offsets[BSP_LUMP_COUNT];
+	size_t total = 0;
+	for(int i = 0; i < BSP_LUMP_COUNT; ++i) {
+		offsets[i] = total = align_up(total, BSP_CACHE_LINE);
+		total += sizes[i];
 	}
-	if(!read_vertices(fp, &out->header.lumps[LUMP_VERTICES], out)) {
-		bsp_cleanup(out);
+	/* Slack for an allocator that does not honor the requested alignment */
+	total += BSP_CACHE_LINE;
+	BSP_DEBUG("Allocating %zu byte arena...", total);
+	bsp->arena = (uint8_t*)bsp_heap_alloc(bsp, total, BSP_CACHE_LINE);
+	if(!bsp->arena) {
+		BSP_ERROR("Failed to allocate arena");
 		return 0;
 	}
-	if(!read_visdata(fp, &out->header.lumps[LUMP_VISDATA], out)) {
-		bsp_cleanup(out);
-		return 0;
+	bsp->arena_size = total;
+	uint8_t* base = bsp->arena + (align_up((uintptr_t)bsp->arena, BSP_CACHE_LINE) - (uintptr_t)bsp->arena);
+	for(int i = 0; i < BSP_LUMP_COUNT; ++i) {
+		bsp->arena_lumps[i].base = sizes[i] ? base + offsets[i] : NULL;
+		bsp->arena_lumps[i].size = sizes[i];
+		bsp->arena_lumps[i].used = 0;
+	}
+	return 1;
+}
+
+typedef int (*lump_reader_fn)(bsp_source_t* src, const bsp_lump_t* l, bsp_t* bsp);
+
+static const lump_reader_fn lump_readers[BSP_LUMP_COUNT] = {
+	read_entities,
+	read_planes,
+	read_miptex,
+	read_vertices,
+	read_visdata,
+	read_nodes,
+	read_texinfo,
+	read_faces,
+	read_lighting,
+	read_clipnodes,
+	read_leaves,
+	read_facelists,
+	read_edges,
+	read_surfedges,
+	read_models
+};
+
+static void async_lock(bsp_async_t* a) {
+#if defined(_WIN32)
+	EnterCriticalSection(&a->lock);
+#else
+	pthread_mutex_lock(&a->lock);
+#endif
+}
+
+static void async_unlock(bsp_async_t* a) {
+#if defined(_WIN32)
+	LeaveCriticalSection(&a->lock);
+#else
+	pthread_mutex_unlock(&a->lock);
+#endif
+}
+
+/* Reports a finished lump to an asynchronous load, if one is running */
+static void note_lump_done(bsp_t* bsp, int lump) {
+	bsp_async_t* a = bsp->async;
+	if(!a) {
+		return;
+	}
+	async_lock(a);
+	a->progress.lumps_done++;
+	a->progress.bytes_done += (size_t)bsp->header.lumps[lump].length;
+	async_unlock(a);
+}
+
+static int load_lump(bsp_t* bsp, int lump) {
+	uint32_t bit = 1u << lump;
+	bsp->pending &= ~bit;
+	bsp_source_t src = bsp->source;
+	src.region = bsp->arena_lumps[lump];
+	int ok = lump_readers[lump](&src, &bsp->header.lumps[lump], bsp);
+	if(!ok) {
+		bsp->failed |= bit;
+	}
+	note_lump_done(bsp, lump);
+	return ok;
+}
+
+typedef struct {
+	bsp_t* bsp;
+	bsp_source_t src;
+	int lump;
+	int ok;
+} lump_task_t;
+
+static void run_lump_task(void* arg) {
+	lump_task_t* task = (lump_task_t*)arg;
+	task->ok = lump_readers[task->lump](&task->src, &task->bsp->header.lumps[task->lump], task->bsp);
+}
+
+/*
+Submits every pending lump as its own task, largest first. A task reads through a private copy of the
+source into its own arena region and writes only the fields of its lump, so tasks share nothing but
+the allocator and the log sink. The bookkeeping is done here once they have all finished.
+*/
+static int load_lumps_parallel(bsp_t* bsp, const bsp_executor_t* exec) {
+	lump_task_t tasks[BSP_LUMP_COUNT];
+	int count = 0;
+	for(int i = 0; i < BSP_LUMP_COUNT; ++i) {
+		if(!(bsp->pending & (1u << i))) {
+			continue;
+		}
+		int j = count++;
+		for(; j > 0 && bsp->header.lumps[tasks[j - 1].lump].length < bsp->header.lumps[i].length; --j) {
+			tasks[j] = tasks[j - 1];
+		}
+		tasks[j].bsp = bsp;
+		tasks[j].src = bsp->source;
+		tasks[j].src.region = bsp->arena_lumps[i];
+		tasks[j].lump = i;
+		tasks[j].ok = 0;
+	}
+	for(int i = 0; i < count; ++i) {
+		exec->submit(exec->ctx, run_lump_task, &tasks[i]);
+	}
+	exec->wait(exec->ctx);
+
+	int ok = 1;
+	for(int i = 0; i < count; ++i) {
+		uint32_t bit = 1u << tasks[i].lump;
+		bsp->pending &= ~bit;
+		if(!tasks[i].ok) {
+			bsp->failed |= bit;
+			ok = 0;
+		}
+		note_lump_done(bsp, tasks[i].lump);
+	}
+	return ok;
+}
+
+/* Loads a lump that was deferred by BSP_LOAD_LAZY. Accessors take a const bsp, the object itself never is. */
+static void ensure_lump(const bsp_t* bsp, int lump) {
+	if(bsp && (bsp->pending & (1u << lump))) {
+		load_lump((bsp_t*)bsp, lump);
+	}
+}
+
+static int build_pvs_matrix(bsp_t* bsp, const bsp_executor_t* exec);
+
+/* Drops whatever an earlier load left, then takes over the image the source borrows */
+static int load_source(bsp_t* out, bsp_source_t* src, uint32_t lump_mask, const bsp_executor_t* exec) {
+	bsp_cleanup(out);
+	out->mapping = src->mapping;
+	out->mapping_size = src->mapping_size;
+	if((src->flags & BSP_LOAD_BORROW) && src->data) {
+		out->image = src->data;
+		out->image_size = src->size;
 	}
-	if(!read_nodes(fp, &out->header.lumps[LUMP_NODES], out)) {
+	if(!read_header(src, &out->header)) {
+		BSP_ERROR("Failed to read BSP header");
 		bsp_cleanup(out);
 		return 0;
 	}
-	if(!read_texinfo(fp, &out->header.lumps[LUMP_TEXINFO], out)) {
+	if((src->flags & BSP_LOAD_ARENA) && !create_arena(out, src, lump_mask)) {
 		bsp_cleanup(out);
 		return 0;
 	}
-	if(!read_faces(fp, &out->header.lumps[LUMP_FACES], out)) {
-		bsp_cleanup(out);
+	out->source = *src;
+	out->pending = lump_mask & BSP_LUMP_ALL;
+	if(out->async) {
+		bsp_async_t* a = out->async;
+		async_lock(a);
+		for(int i = 0; i < BSP_LUMP_COUNT; ++i) {
+			if((out->pending & (1u << i)) && out->header.lumps[i].length > 0) {
+				a->progress.bytes_total += (size_t)out->header.lumps[i].length;
+			}
+			a->progress.lumps_total += (out->pending >> i) & 1;
+		}
+		async_unlock(a);
+	}
+	out->pvs_matrix_wanted = (src->flags & BSP_LOAD_PVS_MATRIX) != 0;
+	if(src->flags & BSP_LOAD_LAZY) {
+		BSP_DEBUG("Lazy load, lumps are read on first access");
+		return 1;
+	}
+
+	if(exec && !src->serial) {
+		BSP_DEBUG("Loading lumps in parallel");
+		if(!load_lumps_parallel(out, exec)) {
+			bsp_cleanup(out);
+			return 0;
+		}
+	} else {
+		for(int i = 0; i < BSP_LUMP_COUNT; ++i) {
+			if((out->pending & (1u << i)) && !load_lump(out, i)) {
+				bsp_cleanup(out);
+				return 0;
+			}
+		}
+	}
+	memset(&out->source, 0, sizeof(out->source));
+	if(out->pvs_matrix_wanted) {
+		out->pvs_matrix_wanted = 0;
+		if(!build_pvs_matrix(out, exec)) {
+			BSP_WARN("Failed to allocate the PVS matrix, rows are decompressed on demand");
+		}
+	}
+
+	BSP_INFO("Loaded: %zu entities, %zu planes, %d miptex, %zu vertices, %zu bytes visdata, %zu nodes, %zu texinfo, %zu faces, "
+	         "%zu bytes lighting, %zu clipnodes, %zu leaves, %zu facelists, %zu edges, %zu surfedges, %zu models",
+	    out->num_entities, out->num_planes, out->miptex_dir.nummiptex, out->num_vertices, out->visdata.size, out->num_nodes,
+	    out->num_texinfo, out->num_faces, out->lighting.size, out->num_clipnodes, out->num_leaves, out->facelist.count,
+	    out->num_edges, out->surfedges.count, out->num_models);
+	return 1;
+}
+
+int bsp_prefetch(bsp_t* bsp, uint32_t lump_mask) {
+	if(!bsp) {
 		return 0;
 	}
-	if(!read_lighting(fp, &out->header.lumps[LUMP_LIGHTING], out)) {
-		bsp_cleanup(out);
+	for(int i = 0; i < BSP_LUMP_COUNT; ++i) {
+		if(lump_mask & bsp->pending & (1u << i)) {
+			load_lump(bsp, i);
+		}
+	}
+	return (bsp->failed & lump_mask) == 0;
+}
+
+int bsp_load_file(bsp_t* out, FILE* fp) {
+	return bsp_load_file_ex(out, fp, BSP_LUMP_ALL);
+}
+
+int bsp_load_file_ex(bsp_t* out, FILE* fp, uint32_t lump_mask) {
+	BSP_DEBUG("Starting BSP file load...");
+	if(!out || !fp) {
+		BSP_ERROR("Invalid arguments to bsp_load_file");
 		return 0;
 	}
-	if(!read_clipnodes(fp, &out->header.lumps[LUMP_CLIPNODES], out)) {
-		bsp_cleanup(out);
+	bsp_source_t src;
+	file_source(&src, fp, out->load_flags & ~BSP_LOAD_BORROW);
+	return load_source(out, &src, lump_mask, NULL);
+}
+
+int bsp_load_parallel(bsp_t* out, FILE* fp, const bsp_executor_t* exec) {
+	BSP_DEBUG("Starting parallel BSP file load...");
+	if(!out || !fp) {
+		BSP_ERROR("Invalid arguments to bsp_load_parallel");
 		return 0;
 	}
-	if(!read_leaves(fp, &out->header.lumps[LUMP_LEAVES], out)) {
-		bsp_cleanup(out);
+	bsp_source_t src;
+	file_source(&src, fp, out->load_flags & ~BSP_LOAD_BORROW);
+	return load_source(out, &src, BSP_LUMP_ALL, exec);
+}
+
+int bsp_load_io(bsp_t* out, const bsp_io_t* io, const bsp_executor_t* exec) {
+	BSP_DEBUG("Starting BSP load from a custom reader...");
+	if(!out || !io || !io->read_at) {
+		BSP_ERROR("Invalid arguments to bsp_load_io");
 		return 0;
 	}
-	if(!read_facelists(fp, &out->header.lumps[LUMP_FACELISTS], out)) {
-		bsp_cleanup(out);
+	bsp_source_t src;
+	io_source(&src, io, out->load_flags | BSP_LOAD_BORROW);
+	return load_source(out, &src, BSP_LUMP_ALL, exec);
+}
+
+int bsp_load_mmap(bsp_t* out, const char* path) {
+	BSP_DEBUG("Starting BSP mmap load...");
+	if(!out || !path) {
+		BSP_ERROR("Invalid arguments to bsp_load_mmap");
 		return 0;
 	}
-	if(!read_edges(fp, &out->header.lumps[LUMP_EDGES], out)) {
-		bsp_cleanup(out);
+	/* Unmap the previous map before mapping the next one */
+	bsp_cleanup(out);
+	size_t size = 0;
+	void* base = map_file(path, &size);
+	if(!base) {
+		BSP_ERROR("Failed to map %s", path);
 		return 0;
 	}
-	if(!read_surfedges(fp, &out->header.lumps[LUMP_SURFEDGES], out)) {
-		bsp_cleanup(out);
+	bsp_source_t src;
+	memory_source(&src, base, size, out->load_flags | BSP_LOAD_BORROW);
+	src.mapping = base;
+	src.mapping_size = size;
+	return load_source(out, &src, BSP_LUMP_ALL, NULL);
+}
+
+int bsp_load_memory(bsp_t* out, const void* data, size_t size, int flags) {
+	BSP_DEBUG("Starting BSP memory load...");
+	if(!out || !data) {
+		BSP_ERROR("Invalid arguments to bsp_load_memory");
 		return 0;
 	}
-	if(!read_models(fp, &out->header.lumps[LUMP_MODELS], out)) {
-		bsp_cleanup(out);
+	bsp_source_t src;
+	memory_source(&src, data, size, out->load_flags | flags);
+	return load_source(out, &src, BSP_LUMP_ALL, NULL);
+}
+
+#if defined(_WIN32)
+static unsigned __stdcall async_main(void* arg)
+#else
+static void* async_main(void* arg)
+#endif
+{
+	bsp_t* bsp = (bsp_t*)arg;
+	bsp_async_t* a = bsp->async;
+	int ok = 0;
+	FILE* fp = fopen(a->path, "rb");
+	if(fp) {
+		/* The stream is closed below, so nothing may be left pending */
+		bsp_source_t src;
+		file_source(&src, fp, bsp->load_flags & ~(BSP_LOAD_BORROW | BSP_LOAD_LAZY));
+		ok = load_source(bsp, &src, BSP_LUMP_ALL, NULL);
+		fclose(fp);
+	} else {
+		BSP_ERROR("Failed to open %s", a->path);
+	}
+	async_lock(a);
+	a->progress.ok = ok;
+	a->progress.finished = 1;
+	async_unlock(a);
+	if(a->on_done) {
+		a->on_done(bsp, ok, a->ctx);
+	}
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+static void join_async(bsp_async_t* a) {
+	if(a->joined) {
+		return;
+	}
+#if defined(_WIN32)
+	WaitForSingleObject(a->thread, INFINITE);
+	CloseHandle(a->thread);
+#else
+	pthread_join(a->thread, NULL);
+#endif
+	a->joined = 1;
+}
+
+/* Waits for a running asynchronous load and frees its state */
+static void release_async(bsp_t* bsp) {
+	bsp_async_t* a = bsp->async;
+	if(!a) {
+		return;
+	}
+	join_async(a);
+#if defined(_WIN32)
+	DeleteCriticalSection(&a->lock);
+#else
+	pthread_mutex_destroy(&a->lock);
+#endif
+	bsp_heap_free(bsp, a->path, a->path_size);
+	bsp_heap_free(bsp, a, sizeof(*a));
+	bsp->async = NULL;
+}
+
+int bsp_load_async(bsp_t* out, const char* path, bsp_load_done_fn on_done, void* ctx) {
+	BSP_DEBUG("Starting asynchronous BSP load...");
+	if(!out || !path) {
+		BSP_ERROR("Invalid arguments to bsp_load_async");
+		return 0;
+	}
+	release_async(out);
+	bsp_async_t* a = (bsp_async_t*)bsp_heap_alloc(out, sizeof(bsp_async_t), BSP_ALIGNOF(bsp_async_t));
+	if(!a) {
+		BSP_ERROR("Failed to allocate asynchronous load state");
+		return 0;
+	}
+	memset(a, 0, sizeof(*a));
+	a->path_size = strlen(path) + 1;
+	a->path = (char*)bsp_heap_alloc(out, a->path_size, 1);
+	if(!a->path) {
+		bsp_heap_free(out, a, sizeof(*a));
+		BSP_ERROR("Failed to allocate asynchronous load state");
+		return 0;
+	}
+	memcpy(a->path, path, a->path_size);
+	a->on_done = on_done;
+	a->ctx = ctx;
+#if defined(_WIN32)
+	InitializeCriticalSection(&a->lock);
+	out->async = a;
+	a->thread = (HANDLE)_beginthreadex(NULL, 0, async_main, out, 0, NULL);
+	int started = a->thread != 0;
+#else
+	pthread_mutex_init(&a->lock, NULL);
+	out->async = a;
+	int started = pthread_create(&a->thread, NULL, async_main, out) == 0;
+#endif
+	if(!started) {
+		BSP_ERROR("Failed to start loader thread");
+		a->joined = 1;
+		release_async(out);
 		return 0;
 	}
+	return 1;
+}
 
-	fprintf(stderr, "[BSP] ========== BSP FILE LOADED SUCCESSFULLY =========\n");
-	fprintf(stderr, "[BSP] Summary:\n");
-	fprintf(stderr, "[BSP]   Entities: %zu\n", out->num_entities);
-	fprintf(stderr, "[BSP]   Planes: %zu\n", out->num_planes);
-	fprintf(stderr, "[BSP]   Miptex: %d\n", out->miptex_dir.nummiptex);
-	fprintf(stderr, "[BSP]   Vertices: %zu\n", out->num_vertices);
-	fprintf(stderr, "[BSP]   Visdata: %zu bytes\n", out->visdata.size);
-	fprintf(stderr, "[BSP]   Nodes: %zu\n", out->num_nodes);
-	fprintf(stderr, "[BSP]   Texinfo: %zu\n", out->num_texinfo);
-	fprintf(stderr, "[BSP]   Faces: %zu\n", out->num_faces);
-	fprintf(stderr, "[BSP]   Lighting: %zu bytes\n", out->lighting.size);
-	fprintf(stderr, "[BSP]   Clipnodes: %zu\n", out->num_clipnodes);
-	fprintf(stderr, "[BSP]   Leaves: %zu\n", out->num_leaves);
-	fprintf(stderr, "[BSP]   Facelists: %zu\n", out->facelist.count);
-	fprintf(stderr, "[BSP]   Edges: %zu\n", out->num_edges);
-	fprintf(stderr, "[BSP]   Surfedges: %zu\n", out->surfedges.count);
-	fprintf(stderr, "[BSP]   Models: %zu\n", out->num_models);
-	fprintf(stderr, "[BSP] ====================================================\n");
+int bsp_load_progress(const bsp_t* bsp, bsp_load_progress_t* progress) {
+	if(!bsp || !bsp->async || !progress) {
+		return 0;
+	}
+	async_lock(bsp->async);
+	*progress = bsp->async->progress;
+	async_unlock(bsp->async);
 	return 1;
 }
 
+int bsp_load_poll(const bsp_t* bsp) {
+	bsp_load_progress_t progress;
+	return bsp_load_progress(bsp, &progress) && progress.finished;
+}
+
+int bsp_load_wait(bsp_t* bsp) {
+	if(!bsp || !bsp->async) {
+		return 0;
+	}
+	join_async(bsp->async);
+	return bsp->async->progress.ok;
+}
+
 size_t bsp_entity_num_properties(const bsp_t* bsp, size_t entity_index) {
+	ensure_lump(bsp, LUMP_ENTITIES);
 	if(!bsp) {
 		return 0;
 	}
@@ -838,6 +2375,7 @@ size_t bsp_entity_num_properties(const bsp_t* bsp, size_t entity_index) {
 }
 
 const char* bsp_entity_property_key(const bsp_t* bsp, size_t entity_index, size_t prop_index) {
+	ensure_lump(bsp, LUMP_ENTITIES);
 	if(!bsp) {
 		return NULL;
 	}
@@ -852,6 +2390,7 @@ const char* bsp_entity_property_key(const bsp_t* bsp, size_t entity_index, size_
 }
 
 const char* bsp_entity_property_value(const bsp_t* bsp, size_t entity_index, size_t prop_index) {
+	ensure_lump(bsp, LUMP_ENTITIES);
 	if(!bsp) {
 		return NULL;
 	}
@@ -866,45 +2405,116 @@ const char* bsp_entity_property_value(const bsp_t* bsp, size_t entity_index, siz
 }
 
 const char* bsp_entity_get_property(const bsp_t* bsp, size_t entity_index, const char* key) {
-	if(!bsp || !key) {
+	if(!key) {
 		return NULL;
 	}
-	if(entity_index >= bsp->num_entities) {
+	return bsp_entity_get_property_h(bsp, entity_index, bsp_key_hash(key), key);
+}
+
+const char* bsp_entity_get_property_h(const bsp_t* bsp, size_t entity_index, uint32_t hash, const char* key) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	if(!bsp || !key || !bsp->num_keys) {
+		return NULL;
+	}
+	size_t id = find_key(bsp, hash, key);
+	return id == (size_t)-1 ? NULL : bsp_entity_get_property_id(bsp, entity_index, (int32_t)id);
+}
+
+int32_t bsp_key_id(const bsp_t* bsp, const char* key) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	if(!bsp || !key || !bsp->num_keys) {
+		return -1;
+	}
+	size_t id = find_key(bsp, bsp_key_hash(key), key);
+	return id == (size_t)-1 ? -1 : (int32_t)id;
+}
+
+const char* bsp_key_name(const bsp_t* bsp, int32_t key_id) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	if(!bsp || key_id < 0 || (size_t)key_id >= bsp->num_keys) {
 		return NULL;
 	}
+	return bsp->keys[key_id];
+}
+
+int32_t bsp_entity_property_key_id(const bsp_t* bsp, size_t entity_index, size_t prop_index) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	if(!bsp || entity_index >= bsp->num_entities) {
+		return -1;
+	}
 	const bsp_entity_t* ent = &bsp->entities[entity_index];
-	for(size_t i = 0; i < ent->num_properties; ++i) {
-		if(ent->properties[i].key && strcmp(ent->properties[i].key, key) == 0) {
-			return ent->properties[i].value;
-		}
+	if(prop_index >= ent->num_properties) {
+		return -1;
 	}
-	return NULL;
+	return (int32_t)bsp->property_keys[(size_t)(ent->properties - bsp->properties) + prop_index];
+}
+
+const char* bsp_entity_get_property_id(const bsp_t* bsp, size_t entity_index, int32_t key_id) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	if(!bsp || key_id < 0 || entity_index >= bsp->num_entities || !bsp->num_property_slots) {
+		return NULL;
+	}
+	return entity_property_id(bsp, entity_index, (uint32_t)key_id);
+}
+
+const bsp_entity_fields_t* bsp_get_entity_fields(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	if(!bsp || !bsp->fields.present) {
+		return NULL;
+	}
+	return &bsp->fields;
+}
+
+bsp_entity_span_t bsp_find_entities_by_class(const bsp_t* bsp, const char* classname) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	bsp_entity_span_t span = { NULL, 0 };
+	if(!bsp || !classname) {
+		return span;
+	}
+	return find_in_value_index(&bsp->classnames, classname);
+}
+
+bsp_entity_span_t bsp_find_entities_by_targetname(const bsp_t* bsp, const char* targetname) {
+	ensure_lump(bsp, LUMP_ENTITIES);
+	bsp_entity_span_t span = { NULL, 0 };
+	if(!bsp || !targetname) {
+		return span;
+	}
+	return find_in_value_index(&bsp->targetnames, targetname);
 }
 
 size_t bsp_num_vertices(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_VERTICES);
 	return bsp ? bsp->num_vertices : 0;
 }
 size_t bsp_num_planes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_PLANES);
 	return bsp ? bsp->num_planes : 0;
 }
 size_t bsp_num_faces(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_FACES);
 	return bsp ? bsp->num_faces : 0;
 }
 size_t bsp_num_edges(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_EDGES);
 	return bsp ? bsp->num_edges : 0;
 }
 size_t bsp_num_models(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MODELS);
 	return bsp ? bsp->num_models : 0;
 }
 
 size_t bsp_visdata_size(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_VISDATA);
 	return bsp ? bsp->visdata.size : 0;
 }
 size_t bsp_lighting_size(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_LIGHTING);
 	return bsp ? bsp->lighting.size : 0;
 }
 
 size_t bsp_miptex_count(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MIPTEX);
 	return bsp ? bsp->miptex_dir.nummiptex : 0;
 }
 
@@ -914,114 +2524,1624 @@ const bsp_header_t* bsp_get_header(const bsp_t* bsp) {
 }
 
 size_t bsp_get_num_entities(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_ENTITIES);
 	return bsp ? bsp->num_entities : 0;
 }
 const bsp_entity_t* bsp_get_entities(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_ENTITIES);
 	return bsp ? bsp->entities : NULL;
 }
 
 /* Planes */
 size_t bsp_get_num_planes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_PLANES);
 	return bsp ? bsp->num_planes : 0;
 }
 const bsp_plane_t* bsp_get_planes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_PLANES);
 	return bsp ? bsp->planes : NULL;
 }
 
 /* Miptex */
 const bsp_miptex_dir_t* bsp_get_miptex_dir(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MIPTEX);
 	return bsp ? &bsp->miptex_dir : NULL;
 }
 bsp_miptex_t** bsp_get_miptex(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MIPTEX);
 	return bsp ? bsp->miptex : NULL;
 }
 const uint8_t* bsp_get_miptex_raw(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MIPTEX);
 	return bsp ? bsp->miptex_raw : NULL;
 }
 size_t bsp_get_miptex_raw_size(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MIPTEX);
 	return bsp ? bsp->miptex_raw_size : 0;
 }
 
 /* Vertices */
 size_t bsp_get_num_vertices(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_VERTICES);
 	return bsp ? bsp->num_vertices : 0;
 }
 const bsp_vertex_t* bsp_get_vertices(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_VERTICES);
 	return bsp ? bsp->vertices : NULL;
 }
 
 /* Visdata */
 const bsp_visdata_t* bsp_get_visdata(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_VISDATA);
 	return bsp ? &bsp->visdata : NULL;
 }
 
 /* Nodes */
 size_t bsp_get_num_nodes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_NODES);
 	return bsp ? bsp->num_nodes : 0;
 }
 const bsp_node_t* bsp_get_nodes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_NODES);
 	return bsp ? bsp->nodes : NULL;
 }
 
 /* Texinfo */
 size_t bsp_get_num_texinfo(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_TEXINFO);
 	return bsp ? bsp->num_texinfo : 0;
 }
 const bsp_texinfo_t* bsp_get_texinfo(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_TEXINFO);
 	return bsp ? bsp->texinfo : NULL;
 }
 
 /* Faces */
 size_t bsp_get_num_faces(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_FACES);
 	return bsp ? bsp->num_faces : 0;
 }
 const bsp_face_t* bsp_get_faces(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_FACES);
 	return bsp ? bsp->faces : NULL;
 }
 
 /* Lighting */
 const bsp_lighting_t* bsp_get_lighting(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_LIGHTING);
 	return bsp ? &bsp->lighting : NULL;
 }
 
 /* Clipnodes */
 size_t bsp_get_num_clipnodes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_CLIPNODES);
 	return bsp ? bsp->num_clipnodes : 0;
 }
 const bsp_clipnode_t* bsp_get_clipnodes(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_CLIPNODES);
 	return bsp ? bsp->clipnodes : NULL;
 }
 
 /* Leaves */
 size_t bsp_get_num_leaves(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_LEAVES);
 	return bsp ? bsp->num_leaves : 0;
 }
 const bsp_leaf_t* bsp_get_leaves(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_LEAVES);
 	return bsp ? bsp->leaves : NULL;
 }
 
 /* Facelist */
 const bsp_facelist_t* bsp_get_facelist(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_FACELISTS);
 	return bsp ? &bsp->facelist : NULL;
 }
 
 /* Edges */
 size_t bsp_get_num_edges(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_EDGES);
 	return bsp ? bsp->num_edges : 0;
 }
 const bsp_edge_t* bsp_get_edges(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_EDGES);
 	return bsp ? bsp->edges : NULL;
 }
 
 /* Surfedges */
 const bsp_surfedges_t* bsp_get_surfedges(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_SURFEDGES);
 	return bsp ? &bsp->surfedges : NULL;
 }
 
 /* Models */
 size_t bsp_get_num_models(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MODELS);
 	return bsp ? bsp->num_models : 0;
 }
 const bsp_model_t* bsp_get_models(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MODELS);
 	return bsp ? bsp->models : NULL;
 }
+
+/*
+Node tree queries. Children >= 0 are nodes, negative children are leaves numbered -1 - child.
+Every step is bounds checked and a walk ends after num_nodes steps, a malformed file gives -1
+instead of reading out of range or looping.
+*/
+#if defined(BSP_SCAN_WIDTH)
+#define BSP_POINT_LANES 4
+#endif
+
+static int model_headnode(const bsp_t* bsp, int32_t model, int hull, int32_t* head) {
+	if(!bsp || model < 0 || (size_t)model >= bsp->num_models) {
+		return 0;
+	}
+	*head = bsp->models[model].headnode[hull];
+	return 1;
+}
+
+static const bsp_plane_t* node_plane(const bsp_t* bsp, int32_t node) {
+	if(node < 0 || (size_t)node >= bsp->num_nodes) {
+		return NULL;
+	}
+	uint32_t plane = (uint32_t)bsp->nodes[node].plane_index;
+	return plane < bsp->num_planes ? &bsp->planes[plane] : NULL;
+}
+
+static float plane_distance(const bsp_plane_t* plane, const float p[3]) {
+	if((uint32_t)plane->type < 3) {
+		return p[plane->type] - plane->dist;
+	}
+	return plane->normal[0] * p[0] + plane->normal[1] * p[1] + plane->normal[2] * p[2] - plane->dist;
+}
+
+static int32_t point_leaf(const bsp_t* bsp, int32_t node, const float p[3]) {
+	for(size_t steps = 0; node >= 0; ++steps) {
+		const bsp_plane_t* plane = node_plane(bsp, node);
+		if(!plane || steps >= bsp->num_nodes) {
+			return -1;
+		}
+		node = bsp->nodes[node].children[plane_distance(plane, p) > 0 ? 0 : 1];
+	}
+	return -1 - node;
+}
+
+int32_t bsp_point_leaf(const bsp_t* bsp, int32_t model, const float p[3]) {
+	ensure_lump(bsp, LUMP_MODELS);
+	ensure_lump(bsp, LUMP_NODES);
+	ensure_lump(bsp, LUMP_PLANES);
+	int32_t head;
+	if(!p || !model_headnode(bsp, model, 0, &head)) {
+		return -1;
+	}
+	return point_leaf(bsp, head, p);
+}
+
+#if defined(BSP_POINT_LANES)
+#define BSP_BAD_NODE INT32_MIN
+
+static float plane_axis(const bsp_plane_t* plane, uint32_t axis) {
+	uint32_t type = (uint32_t)plane->type;
+	return type < 3 ? (float)(type == axis) : plane->normal[axis];
+}
+
+/*
+Walks BSP_POINT_LANES points down the tree in lockstep: the planes of the lanes' current nodes
+are gathered into vectors, one multiply-add chain gives every distance and the sign mask picks
+each lane's child without a branch. A lane that reached a leaf tests against a zero plane until
+the others finish. Axial planes are gathered as unit normals, so distances match point_leaf.
+*/
+static void point_leaf_lanes(const bsp_t* bsp, int32_t head, const float* xyz, int32_t* out) {
+	static const bsp_plane_t leaf_plane = { { 0.0f, 0.0f, 0.0f }, 0.0f, 3 };
+	__m128 p[3];
+	for(int axis = 0; axis < 3; ++axis) {
+		p[axis] = _mm_setr_ps(xyz[axis], xyz[3 + axis], xyz[6 + axis], xyz[9 + axis]);
+	}
+	int32_t node[BSP_POINT_LANES];
+	for(int lane = 0; lane < BSP_POINT_LANES; ++lane) {
+		node[lane] = head;
+	}
+	for(size_t steps = 0; steps < bsp->num_nodes; ++steps) {
+		if((node[0] & node[1] & node[2] & node[3]) < 0) {
+			break;
+		}
+		const bsp_plane_t* plane[BSP_POINT_LANES];
+		for(int lane = 0; lane < BSP_POINT_LANES; ++lane) {
+			plane[lane] = node[lane] >= 0 ? &bsp->planes[bsp->nodes[node[lane]].plane_index] : &leaf_plane;
+		}
+		/* Built with set rather than stored and reloaded, a vector load of four scalar stores stalls */
+		__m128 d = _mm_setzero_ps();
+		for(uint32_t axis = 0; axis < 3; ++axis) {
+			__m128 normal = _mm_setr_ps(plane_axis(plane[0], axis), plane_axis(plane[1], axis), plane_axis(plane[2], axis), plane_axis(plane[3], axis));
+			d = _mm_add_ps(d, _mm_mul_ps(p[axis], normal));
+		}
+		d = _mm_sub_ps(d, _mm_setr_ps(plane[0]->dist, plane[1]->dist, plane[2]->dist, plane[3]->dist));
+		unsigned front = (unsigned)_mm_movemask_ps(_mm_cmpgt_ps(d, _mm_setzero_ps()));
+		for(int lane = 0; lane < BSP_POINT_LANES; ++lane) {
+			if(node[lane] >= 0) {
+				int32_t child = bsp->nodes[node[lane]].children[((front >> lane) & 1) ^ 1];
+				node[lane] = child < 0 || node_plane(bsp, child) ? child : BSP_BAD_NODE;
+			}
+		}
+	}
+	for(int lane = 0; lane < BSP_POINT_LANES; ++lane) {
+		out[lane] = node[lane] >= 0 || node[lane] == BSP_BAD_NODE ? -1 : -1 - node[lane];
+	}
+}
+#endif
+
+void bsp_point_leaf_batch(const bsp_t* bsp, int32_t model, const float* xyz, size_t n, int32_t* out_leaves) {
+	ensure_lump(bsp, LUMP_MODELS);
+	ensure_lump(bsp, LUMP_NODES);
+	ensure_lump(bsp, LUMP_PLANES);
+	if(!out_leaves) {
+		return;
+	}
+	int32_t head;
+	if(!xyz || !model_headnode(bsp, model, 0, &head) || (head >= 0 && !node_plane(bsp, head))) {
+		for(size_t i = 0; i < n; ++i) {
+			out_leaves[i] = -1;
+		}
+		return;
+	}
+	size_t i = 0;
+#if defined(BSP_POINT_LANES)
+	for(; head >= 0 && i + BSP_POINT_LANES <= n; i += BSP_POINT_LANES) {
+		point_leaf_lanes(bsp, head, &xyz[i * 3], &out_leaves[i]);
+	}
+#endif
+	for(; i < n; ++i) {
+		out_leaves[i] = point_leaf(bsp, head, &xyz[i * 3]);
+	}
+}
+
+/*
+Hull traces, the engine's recursive hull check with an explicit stack. Hull 0 is the node tree
+with leaf contents, the others are clipnode trees whose negative children are contents. Tree
+depth is bounded by BSP_TRACE_DEPTH, deeper trees fail the trace rather than allocate.
+*/
+#define BSP_TRACE_DEPTH 256
+#define BSP_DIST_EPSILON 0.03125f /* impact points stay this far on the near side of a plane */
+
+static size_t hull_size(const bsp_t* bsp, int hull) {
+	return hull ? bsp->num_clipnodes : bsp->num_nodes;
+}
+
+static const bsp_plane_t* hull_plane(const bsp_t* bsp, int hull, int32_t node) {
+	if(node < 0 || (size_t)node >= hull_size(bsp, hull)) {
+		return NULL;
+	}
+	uint32_t plane = (uint32_t)(hull ? bsp->clipnodes[node].planenum : bsp->nodes[node].plane_index);
+	return plane < bsp->num_planes ? &bsp->planes[plane] : NULL;
+}
+
+/* Child of a valid hull node, contents when negative */
+static int32_t hull_child(const bsp_t* bsp, int hull, int32_t node, int side) {
+	if(hull) {
+		return bsp->clipnodes[node].children[side];
+	}
+	int32_t child = bsp->nodes[node].children[side];
+	if(child >= 0) {
+		return child;
+	}
+	size_t leaf = (size_t)(-1 - child);
+	int32_t contents = leaf < bsp->num_leaves ? bsp->leaves[leaf].contents : BSP_CONTENTS_SOLID;
+	return contents < 0 ? contents : BSP_CONTENTS_SOLID;
+}
+
+static int32_t hull_contents(const bsp_t* bsp, int hull, int32_t node, const float p[3]) {
+	for(size_t steps = 0; node >= 0; ++steps) {
+		const bsp_plane_t* plane = hull_plane(bsp, hull, node);
+		if(!plane || steps >= hull_size(bsp, hull)) {
+			return BSP_CONTENTS_SOLID;
+		}
+		node = hull_child(bsp, hull, node, plane_distance(plane, p) < 0);
+	}
+	return node;
+}
+
+/* A node the move crosses, saved while the near side is walked */
+typedef struct {
+	int32_t node;
+	int side; /* side of the start point */
+	const bsp_plane_t* plane;
+	float frac;
+	float p1f, p2f, midf;
+	float p1[3], p2[3], mid[3];
+} trace_frame_t;
+
+static void trace_lerp(const float a[3], const float b[3], float frac, float out[3]) {
+	for(int i = 0; i < 3; ++i) {
+		out[i] = a[i] + frac * (b[i] - a[i]);
+	}
+}
+
+static int trace_hull(const bsp_t* bsp, int hull, int32_t head, const float start[3], const float end[3], bsp_trace_t* trace) {
+	trace_frame_t stack[BSP_TRACE_DEPTH];
+	size_t depth = 0;
+	int32_t node = head;
+	float p1f = 0.0f;
+	float p2f = 1.0f;
+	float p1[3] = { start[0], start[1], start[2] };
+	float p2[3] = { end[0], end[1], end[2] };
+	/*
+	In a tree the parts of the move reach every node at most once. The budget leaves room for
+	compilers that share subtrees and stops a malformed file with cycles.
+	*/
+	size_t visits = 0;
+	size_t max_visits = 4 * hull_size(bsp, hull);
+	for(;;) {
+		/* Walk to a leaf, saving every node the move crosses */
+		while(node >= 0) {
+			const bsp_plane_t* plane = hull_plane(bsp, hull, node);
+			if(!plane || visits++ >= max_visits) {
+				return 0;
+			}
+			float t1 = plane_distance(plane, p1);
+			float t2 = plane_distance(plane, p2);
+			if(t1 >= 0 && t2 >= 0) {
+				node = hull_child(bsp, hull, node, 0);
+				continue;
+			}
+			if(t1 < 0 && t2 < 0) {
+				node = hull_child(bsp, hull, node, 1);
+				continue;
+			}
+			if(depth == BSP_TRACE_DEPTH) {
+				return 0;
+			}
+			trace_frame_t* f = &stack[depth++];
+			f->node = node;
+			f->side = t1 < 0;
+			f->plane = plane;
+			f->frac = (t1 < 0 ? t1 + BSP_DIST_EPSILON : t1 - BSP_DIST_EPSILON) / (t1 - t2);
+			f->frac = f->frac > 0.0f ? (f->frac < 1.0f ? f->frac : 1.0f) : 0.0f; /* NaN from a malformed plane becomes 0 */
+			f->p1f = p1f;
+			f->p2f = p2f;
+			f->midf = p1f + (p2f - p1f) * f->frac;
+			memcpy(f->p1, p1, sizeof(p1));
+			memcpy(f->p2, p2, sizeof(p2));
+			trace_lerp(p1, p2, f->frac, f->mid);
+			node = hull_child(bsp, hull, node, f->side);
+			p2f = f->midf;
+			memcpy(p2, f->mid, sizeof(p2));
+		}
+		if(node == BSP_CONTENTS_SOLID) {
+			trace->startsolid = 1;
+		} else {
+			trace->allsolid = 0;
+			if(node == BSP_CONTENTS_EMPTY) {
+				trace->inopen = 1;
+			} else {
+				trace->inwater = 1;
+			}
+		}
+		/* Near side done, go past the first saved node whose far side is open */
+		for(;;) {
+			if(!depth) {
+				return 1;
+			}
+			trace_frame_t* f = &stack[--depth];
+			int32_t far = hull_child(bsp, hull, f->node, f->side ^ 1);
+			if(hull_contents(bsp, hull, far, f->mid) != BSP_CONTENTS_SOLID) {
+				node = far;
+				p1f = f->midf;
+				p2f = f->p2f;
+				memcpy(p1, f->mid, sizeof(p1));
+				memcpy(p2, f->p2, sizeof(p2));
+				break;
+			}
+			if(trace->allsolid) {
+				return 1;
+			}
+			/* The far side is solid, this is the impact */
+			float sign = f->side ? -1.0f : 1.0f;
+			for(int i = 0; i < 3; ++i) {
+				trace->plane.normal[i] = sign * f->plane->normal[i];
+			}
+			trace->plane.dist = sign * f->plane->dist;
+			trace->plane.type = f->plane->type;
+			float frac = f->frac;
+			float midf = f->midf;
+			float mid[3];
+			memcpy(mid, f->mid, sizeof(mid));
+			while(hull_contents(bsp, hull, head, mid) == BSP_CONTENTS_SOLID) {
+				/* Rounding left the impact point in solid, back up towards the start */
+				frac -= 0.1f;
+				if(frac < 0.0f) {
+					break;
+				}
+				midf = f->p1f + (f->p2f - f->p1f) * frac;
+				trace_lerp(f->p1, f->p2, frac, mid);
+			}
+			trace->fraction = midf;
+			memcpy(trace->endpos, mid, sizeof(mid));
+			return 1;
+		}
+	}
+}
+
+static int trace_model(const bsp_t* bsp, int32_t model, int hull, const float start[3], const float end[3], bsp_trace_t* trace) {
+	memset(trace, 0, sizeof(*trace));
+	trace->allsolid = 1;
+	trace->fraction = 1.0f;
+	memcpy(trace->endpos, end, sizeof(trace->endpos));
+	int32_t head;
+	if(hull >= 0 && hull < BSP_MAX_HULLS && model_headnode(bsp, model, hull, &head) && trace_hull(bsp, hull, head, start, end, trace)) {
+		return 1;
+	}
+	memset(trace, 0, sizeof(*trace));
+	trace->allsolid = 1;
+	trace->startsolid = 1;
+	memcpy(trace->endpos, start, sizeof(trace->endpos));
+	return 0;
+}
+
+static void ensure_trace_lumps(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MODELS);
+	ensure_lump(bsp, LUMP_PLANES);
+	ensure_lump(bsp, LUMP_NODES);
+	ensure_lump(bsp, LUMP_CLIPNODES);
+	ensure_lump(bsp, LUMP_LEAVES);
+}
+
+int32_t bsp_point_contents(const bsp_t* bsp, int hull, const float p[3]) {
+	ensure_trace_lumps(bsp);
+	int32_t head;
+	if(!p || hull < 0 || hull >= BSP_MAX_HULLS || !model_headnode(bsp, 0, hull, &head)) {
+		return BSP_CONTENTS_SOLID;
+	}
+	return hull_contents(bsp, hull, head, p);
+}
+
+int bsp_trace_hull(const bsp_t* bsp, int32_t model, int hull, const float start[3], const float end[3], bsp_trace_t* out_trace) {
+	ensure_trace_lumps(bsp);
+	if(!out_trace || !start || !end) {
+		return 0;
+	}
+	return trace_model(bsp, model, hull, start, end, out_trace);
+}
+
+/*
+Splits [0, n) into contiguous chunks of at least min_chunk items, each submitted to exec as a
+task, and waits for them. Runs fn once over the whole range without exec.
+*/
+#define BSP_RANGE_TASKS 64 /* most chunks work is split into */
+
+typedef void (*range_fn_t)(void* ctx, size_t begin, size_t end);
+
+typedef struct {
+	range_fn_t fn;
+	void* ctx;
+	size_t begin;
+	size_t end;
+} range_task_t;
+
+static void run_range_task(void* arg) {
+	range_task_t* task = (range_task_t*)arg;
+	task->fn(task->ctx, task->begin, task->end);
+}
+
+static void parallel_for(const bsp_executor_t* exec, size_t n, size_t min_chunk, range_fn_t fn, void* ctx) {
+	size_t count = exec ? (n + min_chunk - 1) / min_chunk : 1;
+	count = count < BSP_RANGE_TASKS ? count : BSP_RANGE_TASKS;
+	if(count <= 1) {
+		fn(ctx, 0, n);
+		return;
+	}
+	range_task_t tasks[BSP_RANGE_TASKS];
+	for(size_t i = 0; i < count; ++i) {
+		tasks[i].fn = fn;
+		tasks[i].ctx = ctx;
+		tasks[i].begin = n * i / count;
+		tasks[i].end = n * (i + 1) / count;
+		exec->submit(exec->ctx, run_range_task, &tasks[i]);
+	}
+	exec->wait(exec->ctx);
+}
+
+#define BSP_TRACE_CHUNK 256 /* fewest traces worth a task */
+
+typedef struct {
+	const bsp_t* bsp;
+	const bsp_trace_req_t* reqs;
+	bsp_trace_result_t* out;
+	const uint32_t* order; /* request of each position, NULL for request order */
+} trace_batch_t;
+
+static void run_traces(void* ctx, size_t begin, size_t end) {
+	trace_batch_t* batch = (trace_batch_t*)ctx;
+	for(size_t i = begin; i < end; ++i) {
+		size_t r = batch->order ? batch->order[i] : i;
+		const bsp_trace_req_t* req = &batch->reqs[r];
+		batch->out[r].ok = trace_model(batch->bsp, req->model, req->hull, req->start, req->end, &batch->out[r].trace);
+	}
+}
+
+/*
+Counting sort of the requests by the world leaf of their start, so neighbouring traces walk the
+same nodes one after another. NULL when the order cannot be allocated, the batch then runs as given.
+*/
+static uint32_t* trace_order(const bsp_t* bsp, const bsp_trace_req_t* reqs, size_t n, size_t* out_size) {
+	int32_t head;
+	if(n < 2 || n > UINT32_MAX || !model_headnode(bsp, 0, 0, &head)) {
+		return NULL;
+	}
+	size_t buckets = bsp->num_leaves + 1; /* bucket 0 for starts outside any leaf */
+	size_t size = (2 * n + buckets + 1) * sizeof(uint32_t);
+	uint32_t* order = (uint32_t*)bsp_heap_alloc((bsp_t*)bsp, size, sizeof(uint32_t));
+	if(!order) {
+		return NULL;
+	}
+	uint32_t* keys = order + n;
+	uint32_t* counts = keys + n;
+	memset(counts, 0, (buckets + 1) * sizeof(uint32_t));
+	for(size_t i = 0; i < n; ++i) {
+		int32_t leaf = point_leaf(bsp, head, reqs[i].start);
+		keys[i] = leaf >= 0 && (size_t)leaf < bsp->num_leaves ? (uint32_t)leaf + 1 : 0;
+		counts[keys[i] + 1]++;
+	}
+	for(size_t b = 1; b <= buckets; ++b) {
+		counts[b] += counts[b - 1];
+	}
+	for(size_t i = 0; i < n; ++i) {
+		order[counts[keys[i]]++] = (uint32_t)i;
+	}
+	*out_size = size;
+	return order;
+}
+
+void bsp_trace_batch(const bsp_t* bsp, const bsp_trace_req_t* reqs, size_t n, bsp_trace_result_t* out, const bsp_executor_t* exec) {
+	ensure_trace_lumps(bsp);
+	if(!bsp || !reqs || !out || !n) {
+		return;
+	}
+	size_t order_size = 0;
+	uint32_t* order = trace_order(bsp, reqs, n, &order_size);
+	trace_batch_t batch;
+	batch.bsp = bsp;
+	batch.reqs = reqs;
+	batch.out = out;
+	batch.order = order;
+	parallel_for(exec, n, BSP_TRACE_CHUNK, run_traces, &batch);
+	if(order) {
+		bsp_heap_free((bsp_t*)bsp, order, order_size);
+	}
+}
+
+/*
+Visibility. The visdata lump holds one run-length compressed row per leaf: non-zero bytes are
+literal, a zero byte is followed by the number of zero bytes it stands for. Row bit i is leaf
+i + 1, the solid leaf 0 has no bit. A leaf without a row sees everything, as in the engine.
+*/
+/* Every PVS size derives from this. visleafs comes from the file, it is held to the leaves there are. */
+static size_t pvs_leaf_count(const bsp_t* bsp) {
+	size_t leaves = bsp->num_leaves ? bsp->num_leaves - 1 : 0;
+	if(bsp->num_models) {
+		int32_t visleafs = bsp->models[0].visleafs;
+		return visleafs <= 0 ? 0 : (size_t)visleafs < leaves ? (size_t)visleafs : leaves;
+	}
+	return leaves;
+}
+
+static size_t pvs_row_size(const bsp_t* bsp) {
+	return (pvs_leaf_count(bsp) + 7) / 8;
+}
+
+/* Clears the bits past the last leaf */
+static void clear_row_padding(const bsp_t* bsp, uint8_t* out, size_t row) {
+	size_t leaves = pvs_leaf_count(bsp);
+	if(row && (leaves & 7)) {
+		out[row - 1] &= (uint8_t)((1u << (leaves & 7)) - 1);
+	}
+}
+
+/* Decodes the row at offset into row bytes, a truncated row sees nothing past its end */
+static void decompress_row(const bsp_t* bsp, const uint8_t* in, size_t size, size_t offset, uint8_t* out, size_t row) {
+	size_t n = 0;
+	for(size_t pos = offset; n < row && pos < size;) {
+		if(in[pos]) {
+			/* Copy literals up to the next zero in one go */
+			size_t avail = size - pos < row - n ? size - pos : row - n;
+			const uint8_t* zero = (const uint8_t*)memchr(in + pos, 0, avail);
+			size_t len = zero ? (size_t)(zero - (in + pos)) : avail;
+			memcpy(out + n, in + pos, len);
+			n += len;
+			pos += len;
+			continue;
+		}
+		size_t run = pos + 1 < size ? in[pos + 1] : 0;
+		run = run < row - n ? run : row - n;
+		memset(out + n, 0, run);
+		n += run;
+		pos += 2;
+	}
+	memset(out + n, 0, row - n);
+	clear_row_padding(bsp, out, row);
+}
+
+static void decompress_vis(const bsp_t* bsp, int32_t leaf, uint8_t* out, size_t row) {
+	int32_t visofs = leaf > 0 && (size_t)leaf < bsp->num_leaves ? bsp->leaves[leaf].visofs : -1;
+	if(visofs < 0 || (size_t)visofs >= bsp->visdata.size) {
+		memset(out, 0xff, row);
+		clear_row_padding(bsp, out, row);
+		return;
+	}
+	decompress_row(bsp, bsp->visdata.data, bsp->visdata.size, (size_t)visofs, out, row);
+}
+
+static void ensure_vis_lumps(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_VISDATA);
+	ensure_lump(bsp, LUMP_LEAVES);
+	ensure_lump(bsp, LUMP_MODELS);
+}
+
+/*
+Dense PVS matrix, one row per leaf padded to a cache line so rows never share one and can be
+read a word at a time. Rows are decompressed in chunks that run as separate tasks.
+*/
+#define BSP_PVS_CHUNK 64 /* fewest rows worth a task */
+
+static size_t pvs_stride(const bsp_t* bsp) {
+	return align_up(pvs_row_size(bsp), BSP_CACHE_LINE);
+}
+
+/* Leaf rows decompressed into a dense matrix */
+typedef struct {
+	const bsp_t* bsp;
+	uint8_t* rows;
+	size_t stride;
+} vis_rows_t;
+
+static void decompress_rows(void* ctx, size_t begin, size_t end) {
+	vis_rows_t* rows = (vis_rows_t*)ctx;
+	size_t row = pvs_row_size(rows->bsp);
+	for(size_t leaf = begin; leaf < end; ++leaf) {
+		uint8_t* out = rows->rows + leaf * rows->stride;
+		decompress_vis(rows->bsp, (int32_t)leaf, out, row);
+		memset(out + row, 0, rows->stride - row);
+	}
+}
+
+static int build_pvs_matrix(bsp_t* bsp, const bsp_executor_t* exec) {
+	if(bsp->pvs_matrix) {
+		return 1;
+	}
+	size_t stride = pvs_stride(bsp);
+	if(!bsp->num_leaves || !stride) {
+		return 1;
+	}
+	if(bsp->num_leaves > (size_t)-1 / stride) {
+		return 0;
+	}
+	size_t size = bsp->num_leaves * stride;
+	bsp->pvs_matrix = (uint8_t*)bsp_heap_alloc(bsp, size, BSP_CACHE_LINE);
+	if(!bsp->pvs_matrix) {
+		return 0;
+	}
+	bsp->pvs_matrix_size = size;
+	bsp->pvs_stride = stride;
+	vis_rows_t rows;
+	rows.bsp = bsp;
+	rows.rows = bsp->pvs_matrix;
+	rows.stride = stride;
+	parallel_for(exec, bsp->num_leaves, BSP_PVS_CHUNK, decompress_rows, &rows);
+	BSP_INFO("PVS matrix: %zu leaves, %zu bytes", bsp->num_leaves, size);
+	return 1;
+}
+
+/* Builds a matrix deferred by BSP_LOAD_LAZY, like ensure_lump */
+static void ensure_pvs_matrix(const bsp_t* bsp) {
+	if(bsp->pvs_matrix_wanted) {
+		bsp_t* b = (bsp_t*)bsp;
+		b->pvs_matrix_wanted = 0;
+		if(!build_pvs_matrix(b, NULL)) {
+			BSP_WARN("Failed to allocate the PVS matrix, rows are decompressed on demand");
+		}
+	}
+}
+
+/* One bit of a compressed row, decoding no further than its byte */
+static int vis_bit(const bsp_t* bsp, int32_t leaf, size_t bit) {
+	const uint8_t* in = bsp->visdata.data;
+	size_t size = bsp->visdata.size;
+	int32_t visofs = leaf > 0 ? bsp->leaves[leaf].visofs : -1;
+	if(visofs < 0 || (size_t)visofs >= size) {
+		return 1;
+	}
+	size_t byte = bit >> 3;
+	size_t n = 0;
+	for(size_t pos = (size_t)visofs; pos < size;) {
+		if(in[pos]) {
+			if(n == byte) {
+				return (in[pos] >> (bit & 7)) & 1;
+			}
+			n++;
+			pos++;
+			continue;
+		}
+		n += pos + 1 < size ? in[pos + 1] : 0;
+		if(byte < n) {
+			return 0;
+		}
+		pos += 2;
+	}
+	return 0;
+}
+
+size_t bsp_pvs_matrix_size(const bsp_t* bsp) {
+	/* Sized from the leaf count alone, visdata stays unread */
+	ensure_lump(bsp, LUMP_LEAVES);
+	ensure_lump(bsp, LUMP_MODELS);
+	if(!bsp) {
+		return 0;
+	}
+	size_t stride = pvs_stride(bsp);
+	return stride && bsp->num_leaves <= (size_t)-1 / stride ? bsp->num_leaves * stride : 0;
+}
+
+int bsp_build_pvs_matrix(bsp_t* bsp, const bsp_executor_t* exec) {
+	ensure_vis_lumps(bsp);
+	if(!bsp) {
+		return 0;
+	}
+	bsp->pvs_matrix_wanted = 0;
+	return build_pvs_matrix(bsp, exec);
+}
+
+const uint8_t* bsp_pvs_row(const bsp_t* bsp, int32_t leaf) {
+	ensure_vis_lumps(bsp);
+	if(!bsp || leaf < 0 || (size_t)leaf >= bsp->num_leaves) {
+		return NULL;
+	}
+	ensure_pvs_matrix(bsp);
+	return bsp->pvs_matrix ? bsp->pvs_matrix + (size_t)leaf * bsp->pvs_stride : NULL;
+}
+
+int bsp_leaf_can_see(const bsp_t* bsp, int32_t a, int32_t b) {
+	ensure_vis_lumps(bsp);
+	if(!bsp || a < 0 || (size_t)a >= bsp->num_leaves || b <= 0 || (size_t)b > pvs_leaf_count(bsp)) {
+		return 0;
+	}
+	ensure_pvs_matrix(bsp);
+	size_t bit = (size_t)b - 1;
+	if(bsp->pvs_matrix) {
+		return (bsp->pvs_matrix[(size_t)a * bsp->pvs_stride + (bit >> 3)] >> (bit & 7)) & 1;
+	}
+	return vis_bit(bsp, a, bit);
+}
+
+size_t bsp_pvs_row_size(const bsp_t* bsp) {
+	ensure_vis_lumps(bsp);
+	return bsp ? pvs_row_size(bsp) : 0;
+}
+
+int bsp_leaf_pvs(const bsp_t* bsp, int32_t leaf, uint8_t* out_bits) {
+	ensure_vis_lumps(bsp);
+	if(!bsp || !out_bits || leaf < 0 || (size_t)leaf >= bsp->num_leaves) {
+		return 0;
+	}
+	ensure_pvs_matrix(bsp);
+	if(bsp->pvs_matrix) {
+		memcpy(out_bits, bsp->pvs_matrix + (size_t)leaf * bsp->pvs_stride, pvs_row_size(bsp));
+	} else {
+		decompress_vis(bsp, leaf, out_bits, pvs_row_size(bsp));
+	}
+	return 1;
+}
+
+static void free_pvs_cache(bsp_t* bsp) {
+	pvs_cache_t* cache = &bsp->pvs_cache;
+	if(cache->block) {
+		bsp_heap_free(bsp, cache->block, cache->block_size);
+	}
+	memset(cache, 0, sizeof(*cache));
+}
+
+void bsp_set_pvs_cache(bsp_t* bsp, size_t max_rows) {
+	if(bsp) {
+		free_pvs_cache(bsp);
+		bsp->pvs_cache_rows = max_rows;
+	}
+}
+
+static int create_pvs_cache(bsp_t* bsp) {
+	pvs_cache_t* cache = &bsp->pvs_cache;
+	size_t capacity = bsp->pvs_cache_rows ? bsp->pvs_cache_rows : 1;
+	capacity = capacity < bsp->num_leaves ? capacity : bsp->num_leaves;
+	size_t row = pvs_row_size(bsp);
+	size_t rows_size = align_up(capacity * row, BSP_DEFAULT_ALIGN);
+	size_t entries_size = align_up(capacity * sizeof(pvs_entry_t), BSP_DEFAULT_ALIGN);
+	size_t size = rows_size + entries_size + bsp->num_leaves * sizeof(int32_t);
+	cache->block = (uint8_t*)bsp_heap_alloc(bsp, size, BSP_CACHE_LINE);
+	if(!cache->block) {
+		return 0;
+	}
+	cache->block_size = size;
+	cache->row_size = row;
+	cache->capacity = capacity;
+	cache->count = 0;
+	cache->rows = cache->block;
+	cache->entries = (pvs_entry_t*)(cache->block + rows_size);
+	cache->slots = (int32_t*)(cache->block + rows_size + entries_size);
+	memset(cache->slots, 0xff, bsp->num_leaves * sizeof(int32_t));
+	cache->head = BSP_PVS_NONE;
+	cache->tail = BSP_PVS_NONE;
+	return 1;
+}
+
+static void pvs_unlink(pvs_cache_t* cache, uint32_t slot) {
+	pvs_entry_t* e = &cache->entries[slot];
+	if(e->prev != BSP_PVS_NONE) {
+		cache->entries[e->prev].next = e->next;
+	} else {
+		cache->head = e->next;
+	}
+	if(e->next != BSP_PVS_NONE) {
+		cache->entries[e->next].prev = e->prev;
+	} else {
+		cache->tail = e->prev;
+	}
+}
+
+static void pvs_push_front(pvs_cache_t* cache, uint32_t slot) {
+	pvs_entry_t* e = &cache->entries[slot];
+	e->prev = BSP_PVS_NONE;
+	e->next = cache->head;
+	if(cache->head != BSP_PVS_NONE) {
+		cache->entries[cache->head].prev = slot;
+	} else {
+		cache->tail = slot;
+	}
+	cache->head = slot;
+}
+
+const uint8_t* bsp_leaf_pvs_cached(bsp_t* bsp, int32_t leaf) {
+	ensure_vis_lumps(bsp);
+	if(!bsp || leaf < 0 || (size_t)leaf >= bsp->num_leaves) {
+		return NULL;
+	}
+	ensure_pvs_matrix(bsp);
+	if(bsp->pvs_matrix) {
+		return bsp->pvs_matrix + (size_t)leaf * bsp->pvs_stride;
+	}
+	pvs_cache_t* cache = &bsp->pvs_cache;
+	if(!cache->block && !create_pvs_cache(bsp)) {
+		return NULL;
+	}
+	int32_t cached = cache->slots[leaf];
+	if(cached >= 0) {
+		uint32_t slot = (uint32_t)cached;
+		if(cache->head != slot) {
+			pvs_unlink(cache, slot);
+			pvs_push_front(cache, slot);
+		}
+		return cache->rows + slot * cache->row_size;
+	}
+	uint32_t slot;
+	if(cache->count < cache->capacity) {
+		slot = (uint32_t)cache->count++;
+	} else {
+		slot = cache->tail;
+		cache->slots[cache->entries[slot].leaf] = -1;
+		pvs_unlink(cache, slot);
+	}
+	cache->entries[slot].leaf = leaf;
+	cache->slots[leaf] = (int32_t)slot;
+	pvs_push_front(cache, slot);
+	uint8_t* row = cache->rows + slot * cache->row_size;
+	decompress_vis(bsp, leaf, row, cache->row_size);
+	return row;
+}
+
+/*
+PAS: a leaf can hear every leaf that some leaf in its PVS can see, the OR of the PVS rows of the
+leaves it sees, as the engine's server computes at map load. Rows are ORed a vector at a time over
+a dense PVS, the matrix when there is one and a temporary copy otherwise, one task per chunk of
+leaves. BSP_PAS_COMPRESSED then run-length compresses the rows like visdata.
+*/
+#define BSP_PAS_CHUNK 16 /* fewest rows worth a task */
+
+static void or_row(uint8_t* dst, const uint8_t* src, size_t size) {
+	size_t i = 0;
+#if defined(BSP_SCAN_WIDTH)
+	for(; i + BSP_SCAN_WIDTH <= size; i += BSP_SCAN_WIDTH) {
+		scan_store(dst + i, scan_or(scan_load(dst + i), scan_load(src + i)));
+	}
+#endif
+	for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t a;
+		uint64_t b;
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a |= b;
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for(; i < size; ++i) {
+		dst[i] |= src[i];
+	}
+}
+
+typedef struct {
+	const bsp_t* bsp;
+	const uint8_t* pvs;
+	uint8_t* pas;
+	size_t stride; /* of both, a multiple of BSP_CACHE_LINE */
+	uint32_t* offsets; /* BSP_PAS_COMPRESSED: row sizes, then offsets into packed */
+	uint8_t* packed;
+} pas_rows_t;
+
+static void or_visible_rows(void* ctx, size_t begin, size_t end) {
+	pas_rows_t* rows = (pas_rows_t*)ctx;
+	size_t row = pvs_row_size(rows->bsp);
+	size_t leaves = rows->bsp->num_leaves;
+	for(size_t leaf = begin; leaf < end; ++leaf) {
+		const uint8_t* pvs = rows->pvs + leaf * rows->stride;
+		uint8_t* pas = rows->pas + leaf * rows->stride;
+		memcpy(pas, pvs, rows->stride);
+		for(size_t i = 0; i < row; ++i) {
+			if(!pvs[i]) {
+				continue;
+			}
+			for(unsigned bit = 0; bit < 8; ++bit) {
+				size_t seen = i * 8 + bit + 1;
+				if(((pvs[i] >> bit) & 1) && seen < leaves) {
+					or_row(pas, rows->pvs + seen * rows->stride, rows->stride);
+				}
+			}
+		}
+	}
+}
+
+/* Engine visdata encoding, returns the bytes written, or that would be with out NULL */
+static size_t compress_row(const uint8_t* in, size_t row, uint8_t* out) {
+	size_t n = 0;
+	for(size_t i = 0; i < row;) {
+		if(in[i]) {
+			if(out) {
+				out[n] = in[i];
+			}
+			n++;
+			i++;
+			continue;
+		}
+		size_t run = 0;
+		for(; i < row && !in[i] && run < 255; ++i) {
+			run++;
+		}
+		if(out) {
+			out[n] = 0;
+			out[n + 1] = (uint8_t)run;
+		}
+		n += 2;
+	}
+	return n;
+}
+
+static void measure_pas_rows(void* ctx, size_t begin, size_t end) {
+	pas_rows_t* rows = (pas_rows_t*)ctx;
+	size_t row = pvs_row_size(rows->bsp);
+	for(size_t leaf = begin; leaf < end; ++leaf) {
+		rows->offsets[leaf] = (uint32_t)compress_row(rows->pas + leaf * rows->stride, row, NULL);
+	}
+}
+
+static void compress_pas_rows(void* ctx, size_t begin, size_t end) {
+	pas_rows_t* rows = (pas_rows_t*)ctx;
+	size_t row = pvs_row_size(rows->bsp);
+	for(size_t leaf = begin; leaf < end; ++leaf) {
+		compress_row(rows->pas + leaf * rows->stride, row, rows->packed + rows->offsets[leaf]);
+	}
+}
+
+static void free_pas(bsp_t* bsp) {
+	if(bsp->pas) {
+		bsp_heap_free(bsp, bsp->pas, bsp->pas_size);
+	}
+	if(bsp->pas_offsets) {
+		bsp_heap_free(bsp, bsp->pas_offsets, bsp->pas_rows * sizeof(uint32_t));
+	}
+	bsp->pas = NULL;
+	bsp->pas_size = 0;
+	bsp->pas_offsets = NULL;
+	bsp->pas_rows = 0;
+}
+
+/* Moves the dense rows into the compressed form, the dense block is freed either way */
+static int compress_pas(bsp_t* bsp, pas_rows_t* rows, const bsp_executor_t* exec) {
+	size_t n = bsp->num_leaves;
+	uint8_t* dense = rows->pas;
+	size_t dense_size = n * rows->stride;
+	rows->offsets = (uint32_t*)bsp_heap_alloc(bsp, n * sizeof(uint32_t), sizeof(uint32_t));
+	if(!rows->offsets) {
+		bsp_heap_free(bsp, dense, dense_size);
+		return 0;
+	}
+	parallel_for(exec, n, BSP_PAS_CHUNK, measure_pas_rows, rows);
+	size_t total = 0;
+	for(size_t leaf = 0; leaf < n; ++leaf) {
+		size_t size = rows->offsets[leaf];
+		rows->offsets[leaf] = (uint32_t)total;
+		total += size;
+		if(total > UINT32_MAX) {
+			break;
+		}
+	}
+	bsp->pas_offsets = rows->offsets;
+	bsp->pas_rows = n;
+	bsp->pas = total <= UINT32_MAX ? (uint8_t*)bsp_heap_alloc(bsp, total ? total : 1, 1) : NULL;
+	if(!bsp->pas) {
+		bsp_heap_free(bsp, dense, dense_size);
+		free_pas(bsp);
+		return 0;
+	}
+	bsp->pas_size = total ? total : 1;
+	rows->packed = bsp->pas;
+	parallel_for(exec, n, BSP_PAS_CHUNK, compress_pas_rows, rows);
+	bsp_heap_free(bsp, dense, dense_size);
+	return 1;
+}
+
+int bsp_build_pas(bsp_t* bsp, const bsp_executor_t* exec, int flags) {
+	ensure_vis_lumps(bsp);
+	if(!bsp) {
+		return 0;
+	}
+	ensure_pvs_matrix(bsp);
+	free_pas(bsp);
+	size_t n = bsp->num_leaves;
+	size_t stride = pvs_stride(bsp);
+	if(!n || !stride) {
+		return 1;
+	}
+	if(n > (size_t)-1 / stride) {
+		return 0;
+	}
+	pas_rows_t rows;
+	rows.bsp = bsp;
+	rows.pvs = bsp->pvs_matrix;
+	rows.stride = stride;
+	rows.offsets = NULL;
+	rows.packed = NULL;
+	uint8_t* pvs = NULL;
+	if(!rows.pvs) {
+		vis_rows_t vis;
+		pvs = (uint8_t*)bsp_heap_alloc(bsp, n * stride, BSP_CACHE_LINE);
+		if(!pvs) {
+			return 0;
+		}
+		vis.bsp = bsp;
+		vis.rows = pvs;
+		vis.stride = stride;
+		parallel_for(exec, n, BSP_PVS_CHUNK, decompress_rows, &vis);
+		rows.pvs = pvs;
+	}
+	rows.pas = (uint8_t*)bsp_heap_alloc(bsp, n * stride, BSP_CACHE_LINE);
+	if(rows.pas) {
+		parallel_for(exec, n, BSP_PAS_CHUNK, or_visible_rows, &rows);
+	}
+	if(pvs) {
+		bsp_heap_free(bsp, pvs, n * stride);
+	}
+	if(!rows.pas) {
+		return 0;
+	}
+	if(flags & BSP_PAS_COMPRESSED) {
+		if(!compress_pas(bsp, &rows, exec)) {
+			return 0;
+		}
+	} else {
+		bsp->pas = rows.pas;
+		bsp->pas_size = n * stride;
+	}
+	BSP_INFO("PAS: %zu leaves, %zu bytes%s", n, bsp->pas_size, bsp->pas_offsets ? " compressed" : "");
+	return 1;
+}
+
+int bsp_leaf_pas(const bsp_t* bsp, int32_t leaf, uint8_t* out_bits) {
+	if(!bsp || !bsp->pas || !out_bits || leaf < 0 || (size_t)leaf >= bsp->num_leaves) {
+		return 0;
+	}
+	size_t row = pvs_row_size(bsp);
+	if(bsp->pas_offsets) {
+		decompress_row(bsp, bsp->pas, bsp->pas_size, bsp->pas_offsets[leaf], out_bits, row);
+	} else {
+		memcpy(out_bits, bsp->pas + (size_t)leaf * pvs_stride(bsp), row);
+	}
+	return 1;
+}
+
+const uint8_t* bsp_pas_row(const bsp_t* bsp, int32_t leaf) {
+	if(!bsp || !bsp->pas || bsp->pas_offsets || leaf < 0 || (size_t)leaf >= bsp->num_leaves) {
+		return NULL;
+	}
+	return bsp->pas + (size_t)leaf * pvs_stride(bsp);
+}
+
+/*
+Box queries. The walk follows every side of a plane the box straddles, as BoxOnPlaneSide does in
+the engine: 1 when the box is on the front, 2 on the back, 3 across. Solid leaves are skipped.
+*/
+typedef void (*leaf_fn_t)(void* ctx, int32_t leaf);
+
+static void ensure_box_lumps(const bsp_t* bsp) {
+	ensure_lump(bsp, LUMP_MODELS);
+	ensure_lump(bsp, LUMP_PLANES);
+	ensure_lump(bsp, LUMP_NODES);
+	ensure_lump(bsp, LUMP_LEAVES);
+}
+
+static int box_on_plane_side(const bsp_plane_t* plane, const float mins[3], const float maxs[3]) {
+	if((uint32_t)plane->type < 3) {
+		if(plane->dist <= mins[plane->type]) {
+			return 1;
+		}
+		if(plane->dist >= maxs[plane->type]) {
+			return 2;
+		}
+		return 3;
+	}
+	float front = -plane->dist;
+	float back = -plane->dist;
+	for(int i = 0; i < 3; ++i) {
+		front += plane->normal[i] * (plane->normal[i] < 0 ? mins[i] : maxs[i]);
+		back += plane->normal[i] * (plane->normal[i] < 0 ? maxs[i] : mins[i]);
+	}
+	return (front >= 0 ? 1 : 0) | (back < 0 ? 2 : 0);
+}
+
+/* Calls fn for every non-solid leaf under head the box touches. topnode gets the first node splitting it, or -1. */
+static int walk_box(const bsp_t* bsp, int32_t head, const float mins[3], const float maxs[3], leaf_fn_t fn, void* ctx, int32_t* topnode) {
+	int32_t stack[BSP_TRACE_DEPTH];
+	size_t depth = 0;
+	size_t visits = 0;
+	int32_t node = head;
+	*topnode = -1;
+	for(;;) {
+		if(node < 0) {
+			size_t leaf = (size_t)(-1 - node);
+			if(leaf < bsp->num_leaves && bsp->leaves[leaf].contents != BSP_CONTENTS_SOLID) {
+				fn(ctx, (int32_t)leaf);
+			}
+			if(!depth) {
+				return 1;
+			}
+			node = stack[--depth];
+			continue;
+		}
+		const bsp_plane_t* plane = node_plane(bsp, node);
+		if(!plane || visits++ >= bsp->num_nodes) {
+			return 0;
+		}
+		int sides = box_on_plane_side(plane, mins, maxs);
+		if(sides == 3) {
+			if(*topnode < 0) {
+				*topnode = node;
+			}
+			if(depth == BSP_TRACE_DEPTH) {
+				return 0;
+			}
+			stack[depth++] = bsp->nodes[node].children[1];
+			node = bsp->nodes[node].children[0];
+		} else if(sides) {
+			node = bsp->nodes[node].children[sides - 1];
+		} else if(depth) {
+			node = stack[--depth];
+		} else {
+			return 1;
+		}
+	}
+}
+
+/* ORs the PVS of a leaf into out: literal bytes are merged, zero runs only skipped */
+static void merge_vis(const bsp_t* bsp, int32_t leaf, uint8_t* out, size_t row) {
+	int32_t visofs = (size_t)leaf < bsp->num_leaves ? bsp->leaves[leaf].visofs : -1;
+	if(leaf <= 0 || visofs < 0 || (size_t)visofs >= bsp->visdata.size) {
+		memset(out, 0xff, row);
+		clear_row_padding(bsp, out, row);
+		return;
+	}
+	const uint8_t* in = bsp->visdata.data;
+	size_t size = bsp->visdata.size;
+	size_t n = 0;
+	for(size_t pos = (size_t)visofs; n < row && pos < size;) {
+		if(in[pos]) {
+			size_t avail = size - pos < row - n ? size - pos : row - n;
+			const uint8_t* zero = (const uint8_t*)memchr(in + pos, 0, avail);
+			size_t len = zero ? (size_t)(zero - (in + pos)) : avail;
+			or_row(out + n, in + pos, len);
+			n += len;
+			pos += len;
+			continue;
+		}
+		size_t run = pos + 1 < size ? in[pos + 1] : 0;
+		n += run < row - n ? run : row - n;
+		pos += 2;
+	}
+	clear_row_padding(bsp, out, row);
+}
+
+typedef struct {
+	const bsp_t* bsp;
+	uint8_t* out;
+	size_t row;
+	size_t leaves;
+} pvs_union_t;
+
+static void union_leaf_pvs(void* ctx, int32_t leaf) {
+	pvs_union_t* u = (pvs_union_t*)ctx;
+	if(u->bsp->pvs_matrix) {
+		or_row(u->out, u->bsp->pvs_matrix + (size_t)leaf * u->bsp->pvs_stride, u->row);
+	} else {
+		merge_vis(u->bsp, leaf, u->out, u->row);
+	}
+	++u->leaves;
+}
+
+size_t bsp_pvs_union_box(const bsp_t* bsp, const float mins[3], const float maxs[3], uint8_t* out_bits) {
+	ensure_box_lumps(bsp);
+	ensure_lump(bsp, LUMP_VISDATA);
+	int32_t head;
+	if(!out_bits || !mins || !maxs || !model_headnode(bsp, 0, 0, &head)) {
+		return 0;
+	}
+	ensure_pvs_matrix(bsp);
+	pvs_union_t u;
+	u.bsp = bsp;
+	u.out = out_bits;
+	u.row = pvs_row_size(bsp);
+	u.leaves = 0;
+	memset(out_bits, 0, u.row);
+	int32_t topnode;
+	if(!walk_box(bsp, head, mins, maxs, union_leaf_pvs, &u, &topnode)) {
+		BSP_WARN("Malformed node tree under model 0");
+	}
+	return u.leaves;
+}
+
+size_t bsp_entities_visible(const bsp_t* bsp, const uint8_t* pvs_bits, const bsp_entity_leafsets_t* sets, uint64_t* out_mask) {
+	ensure_vis_lumps(bsp);
+	if(!bsp || !pvs_bits || !sets || !out_mask || (sets->count && (!sets->leaves || !sets->first))) {
+		return 0;
+	}
+	size_t bits = pvs_leaf_count(bsp);
+	size_t visible = 0;
+	for(size_t base = 0; base < sets->count; base += 64) {
+		size_t end = sets->count - base < 64 ? sets->count : base + 64;
+		uint64_t word = 0;
+		for(size_t i = base; i < end; ++i) {
+			for(uint32_t j = sets->first[i]; j < sets->first[i + 1]; ++j) {
+				size_t bit = (size_t)sets->leaves[j] - 1;
+				if(bit < bits && ((pvs_bits[bit >> 3] >> (bit & 7)) & 1)) {
+					word |= (uint64_t)1 << (i - base);
+					++visible;
+					break;
+				}
+			}
+		}
+		out_mask[base / 64] = word;
+	}
+	return visible;
+}
+
+/* Leaves stored while they fit, all of them counted */
+typedef struct {
+	int32_t* out;
+	size_t cap;
+	size_t count;
+} leaf_list_t;
+
+static void list_leaf(void* ctx, int32_t leaf) {
+	leaf_list_t* list = (leaf_list_t*)ctx;
+	if(list->count < list->cap) {
+		list->out[list->count] = leaf;
+	}
+	++list->count;
+}
+
+static size_t box_leaves(const bsp_t* bsp, int32_t head, const float mins[3], const float maxs[3], leaf_list_t* list, int32_t* topnode) {
+	size_t start = list->count;
+	if(!walk_box(bsp, head, mins, maxs, list_leaf, list, topnode)) {
+		list->count = start;
+		*topnode = -1;
+	}
+	return list->count - start;
+}
+
+size_t bsp_box_leaves(const bsp_t* bsp, int32_t model, const float mins[3], const float maxs[3], int32_t* out, size_t cap, int32_t* topnode) {
+	ensure_box_lumps(bsp);
+	int32_t top = -1;
+	int32_t head;
+	size_t count = 0;
+	if(mins && maxs && (out || !cap) && model_headnode(bsp, model, 0, &head)) {
+		leaf_list_t list;
+		list.out = out;
+		list.cap = cap;
+		list.count = 0;
+		count = box_leaves(bsp, head, mins, maxs, &list, &top);
+	}
+	if(topnode) {
+		*topnode = top;
+	}
+	return count;
+}
+
+size_t bsp_box_leaves_batch(const bsp_t* bsp, int32_t model, const float* boxes, size_t n, int32_t* out, size_t cap, uint32_t* first, int32_t* topnodes) {
+	ensure_box_lumps(bsp);
+	int32_t head;
+	if(!boxes || !first || (!out && cap) || !model_headnode(bsp, model, 0, &head)) {
+		return 0;
+	}
+	cap = cap < UINT32_MAX ? cap : UINT32_MAX;
+	leaf_list_t list;
+	list.out = out;
+	list.cap = cap;
+	list.count = 0;
+	first[0] = 0;
+	for(size_t i = 0; i < n; ++i) {
+		const float* box = boxes + i * 6;
+		int32_t top;
+		box_leaves(bsp, head, box, box + 3, &list, &top);
+		first[i + 1] = (uint32_t)(list.count < cap ? list.count : cap);
+		if(topnodes) {
+			topnodes[i] = top;
+		}
+	}
+	return list.count;
+}
+
+/*
+Area nodes, the engine's kd-tree over the world bounds for linking entities. Each level halves
+its node across the longer of x and y. A box is linked to the deepest node that holds it whole,
+so one straddling a split stays on the node above. Nodes are stored as an implicit tree, node i
+having children 2i + 1 in front of the split and 2i + 2 behind it. Links live in one pool
+indexed by id that grows by doubling, each node keeps its links as a list threaded through it.
+*/
+#define BSP_AREA_MAX_DEPTH 12
+#define BSP_AREA_NONE UINT32_MAX
+
+typedef struct {
+	int32_t axis; /* -1 for a node without children */
+	float dist;
+	uint32_t head;
+} area_node_t;
+
+typedef struct {
+	float mins[3];
+	float maxs[3];
+	uint32_t prev;
+	uint32_t next;
+	uint32_t node; /* BSP_AREA_NONE when not linked */
+} area_link_t;
+
+struct bsp_area_t {
+	bsp_allocator_t allocator;
+	plain_fns_t plain; /* copied from a bsp_create bsp, the allocator must not point into the bsp */
+	area_node_t* nodes;
+	size_t num_nodes;
+	int depth;
+	area_link_t* links;
+	size_t num_links;
+};
+
+static void* area_alloc(bsp_area_t* area, size_t size) {
+	return area->allocator.alloc(area->allocator.ctx, size, BSP_CACHE_LINE);
+}
+
+static void area_free(bsp_area_t* area, void* p, size_t size) {
+	area->allocator.free(area->allocator.ctx, p, size);
+}
+
+bsp_area_t* bsp_area_create(const bsp_t* bsp, int depth) {
+	ensure_lump(bsp, LUMP_MODELS);
+	if(!bsp || !bsp->num_models) {
+		return NULL;
+	}
+	depth = depth < 0 ? 0 : depth > BSP_AREA_MAX_DEPTH ? BSP_AREA_MAX_DEPTH : depth;
+	size_t num_nodes = ((size_t)2 << depth) - 1;
+	bsp_allocator_t allocator = bsp->allocator;
+	bsp_area_t* area = (bsp_area_t*)allocator.alloc(allocator.ctx, sizeof(bsp_area_t), BSP_ALIGNOF(bsp_area_t));
+	if(!area) {
+		return NULL;
+	}
+	memset(area, 0, sizeof(*area));
+	area->allocator = allocator;
+	if(allocator.ctx == &bsp->plain) {
+		area->plain = bsp->plain;
+		area->allocator.ctx = &area->plain;
+	}
+	area->nodes = (area_node_t*)area_alloc(area, num_nodes * sizeof(area_node_t));
+	/* Node bounds are only needed to place the splits */
+	float(*bounds)[2][2] = (float(*)[2][2])area_alloc(area, num_nodes * sizeof(*bounds));
+	area->num_nodes = num_nodes;
+	if(!area->nodes || !bounds) {
+		if(bounds) {
+			area_free(area, bounds, num_nodes * sizeof(*bounds));
+		}
+		bsp_area_destroy(area);
+		return NULL;
+	}
+	area->depth = depth;
+	const bsp_model_t* world = &bsp->models[0];
+	for(int i = 0; i < 2; ++i) {
+		bounds[0][0][i] = world->mins[i];
+		bounds[0][1][i] = world->maxs[i];
+	}
+	size_t inner = ((size_t)1 << depth) - 1;
+	for(size_t i = 0; i < num_nodes; ++i) {
+		area_node_t* node = &area->nodes[i];
+		node->head = BSP_AREA_NONE;
+		if(i >= inner) {
+			node->axis = -1;
+			node->dist = 0;
+			continue;
+		}
+		const float* mins = bounds[i][0];
+		const float* maxs = bounds[i][1];
+		int axis = maxs[0] - mins[0] > maxs[1] - mins[1] ? 0 : 1;
+		node->axis = axis;
+		node->dist = 0.5f * (mins[axis] + maxs[axis]);
+		memcpy(bounds[2 * i + 1], bounds[i], sizeof(*bounds));
+		memcpy(bounds[2 * i + 2], bounds[i], sizeof(*bounds));
+		bounds[2 * i + 1][0][axis] = node->dist;
+		bounds[2 * i + 2][1][axis] = node->dist;
+	}
+	area_free(area, bounds, num_nodes * sizeof(*bounds));
+	return area;
+}
+
+void bsp_area_destroy(bsp_area_t* area) {
+	if(!area) {
+		return;
+	}
+	if(area->nodes) {
+		area_free(area, area->nodes, area->num_nodes * sizeof(area_node_t));
+	}
+	if(area->links) {
+		area_free(area, area->links, area->num_links * sizeof(area_link_t));
+	}
+	bsp_allocator_t allocator = area->allocator;
+	allocator.free(allocator.ctx, area, sizeof(bsp_area_t));
+}
+
+/* Grows the pool to hold id, new links are not linked */
+static int area_reserve(bsp_area_t* area, uint32_t id) {
+	if(id < area->num_links) {
+		return 1;
+	}
+	if(id == BSP_AREA_NONE) {
+		return 0;
+	}
+	size_t count = area->num_links ? area->num_links * 2 : 64;
+	count = count > (size_t)id ? count : (size_t)id + 1;
+	count = count < BSP_AREA_NONE ? count : BSP_AREA_NONE;
+	if(count > (size_t)-1 / sizeof(area_link_t)) {
+		return 0;
+	}
+	area_link_t* links = (area_link_t*)allocator_realloc(&area->allocator, area->links, area->num_links * sizeof(area_link_t), count * sizeof(area_link_t), BSP_CACHE_LINE);
+	if(!links) {
+		return 0;
+	}
+	for(size_t i = area->num_links; i < count; ++i) {
+		links[i].node = BSP_AREA_NONE;
+	}
+	area->links = links;
+	area->num_links = count;
+	return 1;
+}
+
+static uint32_t area_node_for(const bsp_area_t* area, const float mins[3], const float maxs[3]) {
+	uint32_t i = 0;
+	for(;;) {
+		const area_node_t* node = &area->nodes[i];
+		if(node->axis < 0) {
+			return i;
+		}
+		if(mins[node->axis] > node->dist) {
+			i = 2 * i + 1;
+		} else if(maxs[node->axis] < node->dist) {
+			i = 2 * i + 2;
+		} else {
+			return i;
+		}
+	}
+}
+
+static void area_remove(bsp_area_t* area, uint32_t id) {
+	area_link_t* link = &area->links[id];
+	if(link->prev != BSP_AREA_NONE) {
+		area->links[link->prev].next = link->next;
+	} else {
+		area->nodes[link->node].head = link->next;
+	}
+	if(link->next != BSP_AREA_NONE) {
+		area->links[link->next].prev = link->prev;
+	}
+	link->node = BSP_AREA_NONE;
+}
+
+static void area_insert(bsp_area_t* area, uint32_t id, uint32_t node) {
+	area_link_t* link = &area->links[id];
+	link->node = node;
+	link->prev = BSP_AREA_NONE;
+	link->next = area->nodes[node].head;
+	if(link->next != BSP_AREA_NONE) {
+		area->links[link->next].prev = id;
+	}
+	area->nodes[node].head = id;
+}
+
+/* Sets the box of a link, moving it to another node only when it has to */
+static void area_place(bsp_area_t* area, uint32_t id, const float mins[3], const float maxs[3]) {
+	area_link_t* link = &area->links[id];
+	memcpy(link->mins, mins, sizeof(link->mins));
+	memcpy(link->maxs, maxs, sizeof(link->maxs));
+	uint32_t node = area_node_for(area, mins, maxs);
+	if(link->node == node) {
+		return;
+	}
+	if(link->node != BSP_AREA_NONE) {
+		area_remove(area, id);
+	}
+	area_insert(area, id, node);
+}
+
+int bsp_area_link(bsp_area_t* area, uint32_t id, const float mins[3], const float maxs[3]) {
+	if(!area || !mins || !maxs || !area_reserve(area, id)) {
+		return 0;
+	}
+	area_place(area, id, mins, maxs);
+	return 1;
+}
+
+void bsp_area_unlink(bsp_area_t* area, uint32_t id) {
+	if(area && id < area->num_links && area->links[id].node != BSP_AREA_NONE) {
+		area_remove(area, id);
+	}
+}
+
+int bsp_area_move(bsp_area_t* area, uint32_t id, const float mins[3], const float maxs[3]) {
+	if(!area || !mins || !maxs || id >= area->num_links || area->links[id].node == BSP_AREA_NONE) {
+		return 0;
+	}
+	area_place(area, id, mins, maxs);
+	return 1;
+}
+
+static int boxes_touch(const float amins[3], const float amaxs[3], const float bmins[3], const float bmaxs[3]) {
+	return amins[0] <= bmaxs[0] && amins[1] <= bmaxs[1] && amins[2] <= bmaxs[2] && amaxs[0] >= bmins[0] && amaxs[1] >= bmins[1] && amaxs[2] >= bmins[2];
+}
+
+size_t bsp_area_query_box(const bsp_area_t* area, const float mins[3], const float maxs[3], uint32_t* out, size_t cap) {
+	if(!area || !mins || !maxs || (!out && cap)) {
+		return 0;
+	}
+	uint32_t stack[BSP_AREA_MAX_DEPTH + 1];
+	size_t depth = 0;
+	size_t count = 0;
+	stack[depth++] = 0;
+	while(depth) {
+		const area_node_t* node = &area->nodes[stack[--depth]];
+		for(uint32_t id = node->head; id != BSP_AREA_NONE; id = area->links[id].next) {
+			const area_link_t* link = &area->links[id];
+			if(boxes_touch(link->mins, link->maxs, mins, maxs)) {
+				if(count < cap) {
+					out[count] = id;
+				}
+				++count;
+			}
+		}
+		if(node->axis < 0) {
+			continue;
+		}
+		uint32_t i = (uint32_t)(node - area->nodes);
+		if(maxs[node->axis] > node->dist) {
+			stack[depth++] = 2 * i + 1;
+		}
+		if(mins[node->axis] < node->dist) {
+			stack[depth++] = 2 * i + 2;
+		}
+	}
+	return count;
+}
@@ -1,3 +1,10 @@
+option("log_level")
+    set_default("debug")
+    set_values("none", "error", "warn", "info", "debug")
+    set_showmenu(true)
+    set_description("Most verbose log level compiled into libbsp")
+option_end()
+
 target("libbsp")
     set_languages("c99")
     set_kind("static")
@@ -5,4 +12,9 @@ target("libbsp")
     add_includedirs("include", {public = true})
     add_includedirs("src", {public = false})
     add_headerfiles("include/**.h")
-target_end()
\ No newline at end of file
+    if not is_plat("windows") then
+        add_syslinks("pthread")
+    end
+    local log_levels = {none = 0, error = 1, warn = 2, info = 3, debug = 4}
+    add_defines("BSP_LOG_LEVEL=" .. log_levels[get_config("log_level") or "debug"])
+target_end()